@@ -0,0 +1,10 @@
+# Writes about 'mb' megabytes of hisp source: quoted rules mixing every token
+# the reader knows, so loading it is mostly reading
+BEGIN {
+  for (size = 0; size < mb * 1024 * 1024; i++) {
+    line = sprintf("{rule-%d \"name \\\"%d\\\"\" (+ %d -%d.5) {a b {c d}} (== x %d)} ; rule %d",
+                   i, i, i, i % 97, i, i)
+    print line
+    size += length(line) + 1
+  }
+}
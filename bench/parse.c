@@ -0,0 +1,97 @@
+/*
+** Parse throughput of mpc's string, file and pipe inputs, on the hisp grammar
+**
+**   parse FILE
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include "mpc.h"
+
+#include <time.h>
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report(const char* input, int ok, mpc_result_t* r, double start, size_t len) {
+  double secs = now() - start;
+  if (ok) {
+    mpc_ast_delete(r->output);
+    printf("mpc %-8s %7.2fs %8.2f MB/s\n", input, secs, len / secs / (1024 * 1024));
+  } else {
+    printf("mpc %-8s failed: ", input);
+    mpc_err_print(r->error);
+    mpc_err_delete(r->error);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s FILE\n", argv[0]);
+    return 1;
+  }
+
+  FILE* f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open '%s'\n", argv[1]);
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  size_t len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* src = malloc(len + 1);
+  len = fread(src, 1, len, f);
+  fclose(f);
+
+  mpc_parser_t* Number  = mpc_new("number");
+  mpc_parser_t* Symbol  = mpc_new("symbol");
+  mpc_parser_t* String  = mpc_new("string");
+  mpc_parser_t* Comment = mpc_new("comment");
+  mpc_parser_t* Sexpr   = mpc_new("sexpr");
+  mpc_parser_t* Qexpr   = mpc_new("qexpr");
+  mpc_parser_t* Expr    = mpc_new("expr");
+  mpc_parser_t* Hisp    = mpc_new("hisp");
+
+  /* The same language as hisp_grammar_init */
+  mpca_lang(MPC_LANG_DEFAULT,
+      "                                                 \
+        number   : /-?[0-9]+\\.?[0-9]*/ ;               \
+        symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=%^<>!&]+/ ; \
+        string   : /\"(\\\\.|[^\"])*\"/ ;               \
+        comment  : /;[^\\r\\n]*/ ;                      \
+        sexpr    : '(' <expr>* ')' ;                    \
+        qexpr    : '{' <expr>* '}' ;                    \
+        expr     : <number>  | <symbol> | <string>      \
+                 | <comment> | <sexpr>  | <qexpr>  ;    \
+        hisp     : /^/ <expr>* /$/ ;                    \
+      ",
+      Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Hisp);
+
+  mpc_result_t r;
+  double start = now();
+  int ok = mpc_nparse(argv[1], src, len, Hisp, &r);
+  report("string", ok, &r, start, len);
+
+  start = now();
+  ok = mpc_parse_contents(argv[1], Hisp, &r);
+  report("file", ok, &r, start, len);
+
+  char* cmd = malloc(strlen(argv[1]) + 16);
+  sprintf(cmd, "cat '%s'", argv[1]);
+  FILE* pipe = popen(cmd, "r");
+  if (pipe != NULL) {
+    start = now();
+    ok = mpc_parse_pipe(argv[1], pipe, Hisp, &r);
+    report("pipe", ok, &r, start, len);
+    pclose(pipe);
+  } else {
+    printf("mpc %-8s failed: could not start cat\n", "pipe");
+  }
+
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Hisp);
+  free(cmd);
+  free(src);
+  return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Times parsing a generated source of BENCH_MB megabytes (4 by default): mpc's
+# string, file and pipe inputs on the hisp grammar, then hisp loading it with
+# its own reader and with --mpc. The source is quoted data, so loading it is
+# almost all reading.
+
+mb=${BENCH_MB:-4}
+data=bench/data.hisp
+awk -v mb="$mb" -f bench/gen.awk > "$data" || exit 1
+echo "$mb MB of source in $data"
+
+./bench/parse "$data" || exit 1
+
+now() { date +%s.%N; }
+for reader in "" --mpc; do
+  start=$(now)
+  ./hisp --no-std $reader "$data" || exit 1
+  end=$(now)
+  awk -v s="$start" -v e="$end" -v mb="$mb" -v r="${reader:-reader}" \
+    'BEGIN { printf "hisp %-7s %7.2fs %8.2f MB/s\n", r, e - s, mb / (e - s) }'
+done
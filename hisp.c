@@ -1,5 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
+/* For MAP_ANONYMOUS and MAP_NORESERVE */
+#define _DEFAULT_SOURCE
+
 #include "mpc.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define HISP_VERSION "0.0.0.1.0"
+
 #ifdef _WIN32
 
 static char buffer[2048];
@@ -42,28 +62,128 @@ void add_history(char* unused) {}
       "Function '%s' passed incorrect number of arguments. Got %i, Expected %i", \
       fn, args->count, expect);
 
+#define LASSERT_FD(fn, args, index) \
+  LASSERT_TYPE(fn, args, index, LVAL_NUM); \
+  LASSERT(args, args->cell[index]->num >= 0 && args->cell[index]->num <= INT_MAX \
+      && args->cell[index]->num == (int)args->cell[index]->num, \
+      "Function '%s' passed %Lg for argument %i. Expected a descriptor", \
+      fn, args->cell[index]->num, index);
+
 #define LASSERT_NON_EMPTY(fn, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
       "Function '%s' passed {} for argument %i.", fn, index);
 
 
-/* Parser declarations */
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *String;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *Hisp;
+struct lenv;
+
+/*
+** Interpreter state
+**
+** Everything an interpreter changes as it runs belongs to its hisp: the mpc
+** grammar and parse context, the reader's tag cache and the global
+** environment. Interpreters share nothing else that is mutable, so a host
+** can run several of them at once, each on its own thread. Values are still
+** allocated with malloc, which is already safe to use from any thread.
+*/
+typedef struct hisp {
+  /* The mpc grammar, only built the first time the mpc reader is used */
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* String;
+  mpc_parser_t* Comment;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Hisp;
+  /* Reused for every string read with the mpc grammar, such as REPL lines */
+  mpc_ctx_t* ctx;
+
+  /* What each mpc tag id means to lval_read */
+  char* tag_kinds;
+  int tag_kinds_num;
+
+  struct lenv* env;
+  /* Held to read or change env, which futures use from other threads */
+  pthread_rwlock_t env_lock;
+  /* Futures still running, guarded by the worker pool's lock */
+  int futures;
+  /*
+   * Messages sent to actors by it, or by actors it made, and not yet handled,
+   * guarded by the worker pool's lock. An actor's own interpreter counts in
+   * 'root', the interpreter that made the actor, or in none if it was loaded
+   * from an image.
+   */
+  int actors;
+  struct hisp* root;
+  /* Where print and the errors of top-level forms go */
+  FILE* out;
+} hisp;
+
+/*
+** Options are set once by main before any interpreter is made, and apply to
+** every interpreter in the process.
+*/
+/* Read sources through the mpc grammar instead of the hand-written reader */
+int hisp_mpc_reader = 0;
+/* Set by --stream: scripts are run with load-stream rather than load */
+int hisp_stream_scripts = 0;
+/* Cleared by --no-std: the standard library is not defined at startup */
+int hisp_builtin_std = 1;
+/* Set by --workers, or else HISP_WORKERS: threads for pmap, pfilter and preduce */
+int hisp_workers = 0;
+/* Set by --profile: where the call stacks sampled while running are written */
+char* hisp_profile = NULL;
+/* HISP_CACHE_DIR if it is set and not empty: where forms read by load are cached */
+char* hisp_cache_dir = NULL;
+
+/*
+ * The grammar is only built the first time the mpc reader is used, as
+ * building it takes longer than everything else hisp does at startup.
+ */
+void hisp_grammar_init(hisp* h) {
+  if (h->Hisp) { return; }
+
+  /* Create some parsers */
+  h->Number  = mpc_new("number");
+  h->Symbol  = mpc_new("symbol");
+  h->String  = mpc_new("string");
+  h->Comment = mpc_new("comment");
+  h->Sexpr   = mpc_new("sexpr");
+  h->Qexpr   = mpc_new("qexpr");
+  h->Expr    = mpc_new("expr");
+  h->Hisp    = mpc_new("hisp");
+
+  /* Define them with the following Language */
+  mpca_lang(MPC_LANG_DEFAULT,
+      "                                                 \
+        number   : /-?[0-9]+\\.?[0-9]*/ ;               \
+        symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=%^<>!&]+/ ; \
+        string   : /\"(\\\\.|[^\"])*\"/ ;               \
+        comment  : /;[^\\r\\n]*/ ;                      \
+        sexpr    : '(' <expr>* ')' ;                    \
+        qexpr    : '{' <expr>* '}' ;                    \
+        expr     : <number>  | <symbol> | <string>      \
+                 | <comment> | <sexpr>  | <qexpr>  ;    \
+        hisp     : /^/ <expr>* /$/ ;                    \
+      ",
+      h->Number, h->Symbol, h->String, h->Comment,
+      h->Sexpr, h->Qexpr, h->Expr, h->Hisp);
+  h->ctx = mpc_ctx_new();
+}
 
 /* Enumeration of possible lval types */
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_FUT, LVAL_CHAN, LVAL_ACTOR };
 
 struct lval;
 struct lenv;
+struct lfuture;
+struct lchan;
+struct lactor;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
+typedef struct lactor lactor;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
@@ -76,19 +196,29 @@ struct lval {
   char* sym;
   char* str;
 
-  // function
+  // function, and the name it was defined as while profiling
   lbuiltin builtin;
+  const char* name;
   lenv* env;
   lval* formals;
   lval* body;
 
-  // expression
+  // expression, and where it was read from while profiling
   int count;
   lval** cell;
+  const char* file;
+  int line;
+
+  // future, channel and actor, shared by every copy of them
+  lfuture* future;
+  lchan* chan;
+  lactor* actor;
 };
 
 struct lenv {
   lenv* par;
+  /* The interpreter a global environment belongs to, NULL in any other */
+  hisp* owner;
   int count;
   char** syms;
   lval** vals;
@@ -100,6 +230,18 @@ void lenv_del(lenv* e);
 
 lenv* lenv_copy(lenv* e);
 
+void lfuture_retain(lfuture* fu);
+
+void lfuture_release(lfuture* fu);
+
+void lchan_retain(lchan* c);
+
+void lchan_release(lchan* c);
+
+void lactor_retain(lactor* ac);
+
+void lactor_release(lactor* ac);
+
 lval* lval_num(long double x) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_NUM;
@@ -146,6 +288,8 @@ lval* lval_sexpr(void) {
   v->type  = LVAL_SEXPR;
   v->count = 0;
   v->cell  = NULL;
+  v->file  = NULL;
+  v->line  = 0;
   return v;
 }
 
@@ -155,6 +299,8 @@ lval* lval_qexpr(void) {
   v->type  = LVAL_QEXPR;
   v->count = 0;
   v->cell  = NULL;
+  v->file  = NULL;
+  v->line  = 0;
   return v;
 }
 
@@ -162,6 +308,7 @@ lval* lval_fun(lbuiltin func) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->builtin  = func;
+  v->name     = NULL;
   return v;
 }
 
@@ -169,6 +316,7 @@ lval* lval_lambda(lval* formals, lval* body) {
   lval* v    = malloc(sizeof(lval));
   v->type    = LVAL_FUN;
   v->builtin = NULL;
+  v->name    = NULL;
   v->env     = lenv_new();
   v->formals = formals;
   v->body    = body;
@@ -195,6 +343,9 @@ void lval_del(lval* v) {
         lval_del(v->body);
       }
       break;
+    case LVAL_FUT: lfuture_release(v->future); break;
+    case LVAL_CHAN: lchan_release(v->chan); break;
+    case LVAL_ACTOR: lactor_release(v->actor); break;
   }
   free(v);
 }
@@ -220,69 +371,78 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-void lval_print(lval* v);
+void lval_print(FILE* f, lval* v);
 
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+void lval_expr_print(FILE* f, lval* v, char open, char close) {
+  fputc(open, f);
   for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+    lval_print(f, v->cell[i]);
     
     if (i != (v->count-1)) {
-      putchar(' ');
+      fputc(' ', f);
     }
   }
-  putchar(close);
+  fputc(close, f);
 }
 
-void lval_print_str(lval* v) {
+void lval_print_str(FILE* f, lval* v) {
   char* escaped = malloc(strlen(v->str) + 1);
   strcpy(escaped, v->str);
   escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
+  fprintf(f, "\"%s\"", escaped);
   free(escaped);
 }
 
-void lval_print(lval* v) {
+void lval_print(FILE* f, lval* v) {
   switch (v->type) {
     case LVAL_NUM:
       if ((int)v->num == v->num) {
-        printf("%i", (int)v->num);
+        fprintf(f, "%i", (int)v->num);
       } else {
-        printf("%.2Lf", v->num);
+        fprintf(f, "%.2Lf", v->num);
       }
       break;
     case LVAL_ERR:
-      printf("Error: %s", v->err);
+      fprintf(f, "Error: %s", v->err);
       break;
     case LVAL_SYM:
-      printf("%s", v->sym);
+      fprintf(f, "%s", v->sym);
       break;
     case LVAL_STR:
-      lval_print_str(v);
+      lval_print_str(f, v);
       break;
     case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')');
+      lval_expr_print(f, v, '(', ')');
       break;
     case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}');
+      lval_expr_print(f, v, '{', '}');
       break;
     case LVAL_FUN:
       if (v->builtin) {
-        printf("<function>");
+        fprintf(f, "<function>");
       } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        fprintf(f, "(\\ ");
+        lval_print(f, v->formals);
+        fputc(' ', f);
+        lval_print(f, v->body);
+        fputc(')', f);
       }
       break;
+    case LVAL_FUT:
+      fprintf(f, "<future>");
+      break;
+    case LVAL_CHAN:
+      fprintf(f, "<channel>");
+      break;
+    case LVAL_ACTOR:
+      fprintf(f, "<actor>");
+      break;
   }
 }
 
-void lval_println(lval* v) {
-  lval_print(v);
-  putchar('\n');
+void lval_println(FILE* f, lval* v) {
+  lval_print(f, v);
+  fputc('\n', f);
 }
 
 lval* lval_copy(lval* v) {
@@ -292,6 +452,7 @@ lval* lval_copy(lval* v) {
   switch(v->type) {
     // copy functions and numbers directly
     case LVAL_FUN: 
+      x->name = v->name;
       if (v->builtin) {
         x->builtin = v->builtin;
       } else {
@@ -319,11 +480,25 @@ lval* lval_copy(lval* v) {
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
+      x->file  = v->file;
+      x->line  = v->line;
       x->cell  = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
       }
       break;
+    case LVAL_FUT:
+      x->future = v->future;
+      lfuture_retain(x->future);
+      break;
+    case LVAL_CHAN:
+      x->chan = v->chan;
+      lchan_retain(x->chan);
+      break;
+    case LVAL_ACTOR:
+      x->actor = v->actor;
+      lactor_retain(x->actor);
+      break;
   }
 
   return x;
@@ -332,6 +507,7 @@ lval* lval_copy(lval* v) {
 lenv* lenv_new(void) {
   lenv* e  = malloc(sizeof(lenv));
   e->par   = NULL;
+  e->owner = NULL;
   e->count = 0;
   e->syms  = NULL;
   e->vals  = NULL;
@@ -349,11 +525,16 @@ void lenv_del(lenv* e) {
 }
 
 lval* lenv_get(lenv* e, lval* k) {
+  lval* x = NULL;
+  if (e->owner) { pthread_rwlock_rdlock(&e->owner->env_lock); }
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
-      return lval_copy(e->vals[i]);
+      x = lval_copy(e->vals[i]);
+      break;
     }
   }
+  if (e->owner) { pthread_rwlock_unlock(&e->owner->env_lock); }
+  if (x) { return x; }
 
   // if no symbol check in parent otherwise error
   if (e->par) {
@@ -364,26 +545,32 @@ lval* lenv_get(lenv* e, lval* k) {
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-  }
+  lval* old = NULL;
+  if (e->owner) { pthread_rwlock_wrlock(&e->owner->env_lock); }
 
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  int i = 0;
+  while (i < e->count && strcmp(e->syms[i], k->sym) != 0) { i++; }
+
+  if (i < e->count) {
+    old = e->vals[i];
+  } else {
+    e->count++;
+    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    e->syms[i] = malloc(strlen(k->sym) + 1);
+    strcpy(e->syms[i], k->sym);
+  }
+  e->vals[i] = lval_copy(v);
 
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  if (e->owner) { pthread_rwlock_unlock(&e->owner->env_lock); }
+  // the old value is deleted after unlocking, to hold the lock for less time
+  if (old) { lval_del(old); }
 }
 
 lenv* lenv_copy(lenv* e) {
   lenv* n  = malloc(sizeof(lenv));
   n->par   = e->par;
+  n->owner = NULL;
   n->count = e->count;
   n->syms  = malloc(sizeof(char*) * n->count);
   n->vals  = malloc(sizeof(lval*) * n->count);
@@ -402,6 +589,18 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   lenv_put(e, k, v);
 }
 
+/* The interpreter evaluating in 'e', found through its global environment */
+hisp* lenv_hisp(lenv* e) {
+  while (e->par) { e = e->par; }
+  return e->owner;
+}
+
+/* Where the interpreter of e prints, stdout if it has none */
+FILE* lenv_out(lenv* e) {
+  hisp* h = lenv_hisp(e);
+  return h ? h->out : stdout;
+}
+
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
@@ -411,6 +610,9 @@ char* ltype_name(int t) {
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_FUT: return "Future";
+    case LVAL_CHAN: return "Channel";
+    case LVAL_ACTOR: return "Actor";
     default: return "Unknown";
   }
 }
@@ -465,6 +667,239 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
   return x;
 }
 
+/*
+** Profiler
+**
+** With --profile, every call pushes a frame naming the function onto a shadow
+** stack, one per OS thread and one per green thread, and a SIGPROF timer
+** samples the stack of whichever thread is using the CPU. The handler may not
+** allocate, so samples are counted in tables made up front, one entry per
+** distinct stack, and written out as folded stacks for flamegraph.pl at exit.
+** Functions are named by the def or = that first bound them, and lambdas by
+** where their body was read from. Builtins are named as in the builtin table.
+*/
+
+/* Frames deeper than this are counted in their caller */
+#define LPROF_DEPTH 256
+/* Distinct stacks, a power of two, and frames kept for them altogether */
+#define LPROF_STACKS (1 << 16)
+#define LPROF_FRAMES (1 << 20)
+#define LPROF_INTERVAL_US 1000
+
+typedef struct {
+  const char* name;
+  const char* file;
+  int line;
+} lframe;
+
+typedef struct {
+  int depth;
+  lframe frames[LPROF_DEPTH];
+} lprof_stack;
+
+typedef struct {
+  unsigned long hash;
+  int first;
+  int depth;
+  long count;
+} lprof_entry;
+
+static struct {
+  char lock;
+  lprof_entry* stacks;
+  int used_stacks;
+  lframe* frames;
+  int used_frames;
+  long dropped;
+} lprof;
+
+/* The stack calls are pushed to, which green threads switch */
+static __thread lprof_stack* lprof_current;
+static __thread lprof_stack lprof_thread;
+
+/* Names and file names outlive the values they came from, so they are kept here for good */
+static pthread_mutex_t lintern_lock = PTHREAD_MUTEX_INITIALIZER;
+static char** lintern_table;
+static int lintern_count;
+static int lintern_cap;
+
+const char* lintern(const char* s) {
+  pthread_mutex_lock(&lintern_lock);
+  unsigned long h = 5381;
+  for (const char* c = s; *c; c++) { h = h * 33 + (unsigned char)*c; }
+
+  if (lintern_count * 2 >= lintern_cap) {
+    int cap = lintern_cap ? lintern_cap * 2 : 256;
+    char** table = calloc(cap, sizeof(char*));
+    for (int i = 0; i < lintern_cap; i++) {
+      if (lintern_table[i] == NULL) { continue; }
+      unsigned long g = 5381;
+      for (char* c = lintern_table[i]; *c; c++) { g = g * 33 + (unsigned char)*c; }
+      int j = g & (cap - 1);
+      while (table[j]) { j = (j + 1) & (cap - 1); }
+      table[j] = lintern_table[i];
+    }
+    free(lintern_table);
+    lintern_table = table;
+    lintern_cap = cap;
+  }
+
+  int i = h & (lintern_cap - 1);
+  while (lintern_table[i] && strcmp(lintern_table[i], s) != 0) {
+    i = (i + 1) & (lintern_cap - 1);
+  }
+  if (lintern_table[i] == NULL) {
+    lintern_table[i] = malloc(strlen(s) + 1);
+    strcpy(lintern_table[i], s);
+    lintern_count++;
+  }
+  char* found = lintern_table[i];
+  pthread_mutex_unlock(&lintern_lock);
+  return found;
+}
+
+/* Name a function after the symbol it is being bound to, unless it has a name */
+void lprof_name(lval* v, char* sym) {
+  if (hisp_profile && v->type == LVAL_FUN && v->name == NULL) {
+    v->name = lintern(sym);
+  }
+}
+
+/* A fresh shadow stack for a green thread, NULL when not profiling */
+lprof_stack* lprof_stack_new(void) {
+  return hisp_profile ? calloc(1, sizeof(lprof_stack)) : NULL;
+}
+
+static void lprof_push(lval* f) {
+  lprof_stack* s = lprof_current;
+  if (s == NULL) { s = lprof_current = &lprof_thread; }
+  if (s->depth < LPROF_DEPTH) {
+    lframe* fr = &s->frames[s->depth];
+    fr->name = f->name;
+    fr->file = f->builtin ? NULL : f->body->file;
+    fr->line = f->builtin ? 0 : f->body->line;
+  }
+  /* The frame must be whole before a sample can see it */
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  s->depth++;
+}
+
+static void lprof_pop(void) {
+  lprof_current->depth--;
+}
+
+static unsigned long lprof_hash(lframe* frames, int depth) {
+  unsigned long h = 5381;
+  for (int i = 0; i < depth; i++) {
+    h = h * 33 + (unsigned long)frames[i].name;
+    h = h * 33 + (unsigned long)frames[i].file;
+    h = h * 33 + (unsigned long)frames[i].line;
+  }
+  return h;
+}
+
+static int lprof_same(lprof_entry* en, unsigned long h, lframe* frames, int depth) {
+  if (en->hash != h || en->depth != depth) { return 0; }
+  lframe* kept = &lprof.frames[en->first];
+  for (int i = 0; i < depth; i++) {
+    if (kept[i].name != frames[i].name || kept[i].file != frames[i].file
+        || kept[i].line != frames[i].line) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Count the stack of the interrupted thread. Only touches memory made up front */
+static void lprof_sample(int sig) {
+  lprof_stack* s = lprof_current;
+  int depth = s ? s->depth : 0;
+  if (depth > LPROF_DEPTH) { depth = LPROF_DEPTH; }
+  lframe* frames = s ? s->frames : NULL;
+  unsigned long h = lprof_hash(frames, depth);
+
+  while (__atomic_test_and_set(&lprof.lock, __ATOMIC_ACQUIRE));
+
+  int i = h & (LPROF_STACKS - 1);
+  while (lprof.stacks[i].count && !lprof_same(&lprof.stacks[i], h, frames, depth)) {
+    i = (i + 1) & (LPROF_STACKS - 1);
+  }
+  lprof_entry* en = &lprof.stacks[i];
+  if (en->count) {
+    en->count++;
+  } else if (lprof.used_stacks < LPROF_STACKS / 2
+      && lprof.used_frames + depth <= LPROF_FRAMES) {
+    memcpy(&lprof.frames[lprof.used_frames], frames, sizeof(lframe) * depth);
+    en->hash  = h;
+    en->first = lprof.used_frames;
+    en->depth = depth;
+    en->count = 1;
+    lprof.used_frames += depth;
+    lprof.used_stacks++;
+  } else {
+    lprof.dropped++;
+  }
+
+  __atomic_clear(&lprof.lock, __ATOMIC_RELEASE);
+}
+
+/* Start sampling. Zero if the timer could not be set */
+int lprof_start(void) {
+  lprof.stacks = calloc(LPROF_STACKS, sizeof(lprof_entry));
+  lprof.frames = calloc(LPROF_FRAMES, sizeof(lframe));
+  if (lprof.stacks == NULL || lprof.frames == NULL) { return 0; }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lprof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0) { return 0; }
+
+  struct itimerval t;
+  t.it_interval.tv_sec  = 0;
+  t.it_interval.tv_usec = LPROF_INTERVAL_US;
+  t.it_value = t.it_interval;
+  return setitimer(ITIMER_PROF, &t, NULL) == 0;
+}
+
+static void lprof_write_frame(FILE* f, lframe* fr) {
+  if (fr->name && fr->file) {
+    fprintf(f, "%s (%s:%i)", fr->name, fr->file, fr->line);
+  } else if (fr->name) {
+    fputs(fr->name, f);
+  } else if (fr->file) {
+    fprintf(f, "lambda (%s:%i)", fr->file, fr->line);
+  } else {
+    fputs("lambda", f);
+  }
+}
+
+/* Stop sampling and write each distinct stack and its count, outermost call first */
+int lprof_stop(char* path) {
+  struct itimerval t;
+  memset(&t, 0, sizeof(t));
+  setitimer(ITIMER_PROF, &t, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  FILE* f = fopen(path, "w");
+  if (f == NULL) { return 0; }
+  for (int i = 0; i < LPROF_STACKS; i++) {
+    lprof_entry* en = &lprof.stacks[i];
+    if (en->count == 0) { continue; }
+    if (en->depth == 0) { fputs("(top level)", f); }
+    for (int d = 0; d < en->depth; d++) {
+      if (d > 0) { fputc(';', f); }
+      lprof_write_frame(f, &lprof.frames[en->first + d]);
+    }
+    fprintf(f, " %ld\n", en->count);
+  }
+  if (lprof.dropped) {
+    fprintf(stderr, "Profile dropped %ld samples of stacks beyond its tables\n", lprof.dropped);
+  }
+  return fclose(f) == 0;
+}
+
 lval* lval_eval(lenv* e, lval* v);
 
 lval* lval_call(lenv* e, lval* f, lval* a);
@@ -536,40 +971,406 @@ lval* lval_read_str(mpc_ast_t* t) {
   return str;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
-  }
-  if(strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
+/* What a tag means to lval_read, worked out once per tag id */
+enum { LTAG_UNSEEN, LTAG_NUMBER, LTAG_SYMBOL, LTAG_STRING,
+       LTAG_SEXPR, LTAG_QEXPR, LTAG_SKIP, LTAG_OTHER };
+
+int ltag_kind(hisp* h, mpc_ast_t* t) {
+  if (t->tag_id >= h->tag_kinds_num) {
+    int n = h->tag_kinds_num ? h->tag_kinds_num : 16;
+    while (n <= t->tag_id) { n *= 2; }
+    h->tag_kinds = realloc(h->tag_kinds, n);
+    memset(h->tag_kinds + h->tag_kinds_num, LTAG_UNSEEN, n - h->tag_kinds_num);
+    h->tag_kinds_num = n;
   }
-  if(strstr(t->tag, "string")) {
-    return lval_read_str(t);
+
+  char* k = &h->tag_kinds[t->tag_id];
+  if (*k == LTAG_UNSEEN) {
+    if (strstr(t->tag, "number"))         { *k = LTAG_NUMBER; }
+    else if (strstr(t->tag, "symbol"))    { *k = LTAG_SYMBOL; }
+    else if (strstr(t->tag, "string"))    { *k = LTAG_STRING; }
+    else if (strstr(t->tag, "qexpr"))     { *k = LTAG_QEXPR; }
+    else if (strstr(t->tag, "sexpr"))     { *k = LTAG_SEXPR; }
+    else if (strcmp(t->tag, ">") == 0)    { *k = LTAG_SEXPR; }
+    else if (strcmp(t->tag, "regex") == 0
+          || strstr(t->tag, "comment"))   { *k = LTAG_SKIP; }
+    else                                  { *k = LTAG_OTHER; }
   }
+  return *k;
+}
 
-  /* If root (>) or sexpr then create empty list */
+lval* lval_read(hisp* h, mpc_ast_t* t) {
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
+
+  switch (ltag_kind(h, t)) {
+    case LTAG_NUMBER: return lval_read_num(t);
+    case LTAG_SYMBOL: return lval_sym(t->contents);
+    case LTAG_STRING: return lval_read_str(t);
+    /* If root (>) or sexpr then create empty list */
+    case LTAG_SEXPR:  x = lval_sexpr(); break;
+    case LTAG_QEXPR:  x = lval_qexpr(); break;
   }
 
   /* Fill this list with any valid expression contained within */
   for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "regex")  == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+    mpc_ast_t* c = t->children[i];
+    if (strchr("(){}", c->contents[0]) && c->contents[0] && !c->contents[1]) { continue; }
+    if (ltag_kind(h, c) == LTAG_SKIP) { continue; }
+    x = lval_add(x, lval_read(h, c));
+  }
+
+  return x;
+}
+
+/* Read an entire parse with the mpc grammar, for comparison with the reader below */
+lval* lval_read_mpc(hisp* h, mpc_result_t* r, int ok) {
+  if (ok) {
+    lval* x = lval_read(h, r->output);
+    mpc_ast_delete(r->output);
+    return x;
+  }
+
+  char* err_msg = mpc_err_string(r->error);
+  mpc_err_delete(r->error);
+
+  // drop the trailing newline mpc adds to its messages
+  size_t n = strlen(err_msg);
+  if (n && err_msg[n - 1] == '\n') { err_msg[n - 1] = '\0'; }
+
+  lval* err = lval_err("%s", err_msg);
+  free(err_msg);
+  return err;
+}
+
+/*
+** Reader
+**
+** A tokenizer and recursive-descent reader for the Hisp syntax which builds
+** lvals in a single pass over the source, without going through an mpc AST.
+** It accepts exactly the language of the grammar in 'main': numbers are
+** tried before symbols, comments and whitespace separate expressions.
+*/
+
+typedef struct {
+  char* filename;
+  /* filename kept for the lists read, while profiling */
+  const char* file;
+  const char* src;
+  size_t len;
+  size_t pos;
+  int row;
+  int col;
+} lreader;
+
+void lreader_init(lreader* r, char* filename, const char* src, size_t len) {
+  r->filename = filename;
+  r->file = hisp_profile ? lintern(filename) : NULL;
+  r->src = src;
+  r->len = len;
+  r->pos = 0;
+  r->row = 0;
+  r->col = 0;
+}
+
+static int lreader_peek(lreader* r, size_t ahead) {
+  if (r->pos + ahead >= r->len) { return EOF; }
+  return (unsigned char)r->src[r->pos + ahead];
+}
+
+static void lreader_advance(lreader* r, size_t n) {
+  while (n-- && r->pos < r->len) {
+    if (r->src[r->pos] == '\n') {
+      r->row++;
+      r->col = 0;
+    } else {
+      r->col++;
+    }
+    r->pos++;
+  }
+}
+
+static int lreader_is_space(int c) {
+  return c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v';
+}
+
+static int lreader_is_digit(int c) {
+  return c >= '0' && c <= '9';
+}
+
+static int lreader_is_symbol(int c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lreader_is_digit(c) ||
+         (c != EOF && c != '\0' && strchr("_+-*/\\=%^<>!&", c) != NULL);
+}
+
+/* Skip whitespace and comments */
+static void lreader_skip(lreader* r) {
+  for (;;) {
+    int c = lreader_peek(r, 0);
+    if (lreader_is_space(c)) {
+      lreader_advance(r, 1);
+    } else if (c == ';') {
+      while (c != EOF && c != '\n' && c != '\r') {
+        lreader_advance(r, 1);
+        c = lreader_peek(r, 0);
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+static lval* lreader_error(lreader* r, char* expected) {
+  char at[8];
+  char* name;
+  int c = lreader_peek(r, 0);
+
+  switch (c) {
+    case EOF:  name = "end of input"; break;
+    case '\0': name = "end of input"; break;
+    case '\n': name = "newline"; break;
+    case '\t': name = "tab"; break;
+    case '\r': name = "carriage return"; break;
+    case ' ':  name = "space"; break;
+    default:
+      snprintf(at, sizeof(at), "'%c'", c);
+      name = at;
+  }
+
+  return lval_err("%s:%i:%i: error: expected %s at %s",
+      r->filename, r->row + 1, r->col + 1, expected, name);
+}
+
+/* Length of the number at the cursor matching -?[0-9]+\.?[0-9]*, or 0 */
+static size_t lreader_number_len(lreader* r) {
+  size_t n = 0;
+  if (lreader_peek(r, n) == '-') { n++; }
+  if (!lreader_is_digit(lreader_peek(r, n))) { return 0; }
+  while (lreader_is_digit(lreader_peek(r, n))) { n++; }
+  if (lreader_peek(r, n) == '.') { n++; }
+  while (lreader_is_digit(lreader_peek(r, n))) { n++; }
+  return n;
+}
+
+static lval* lreader_number(lreader* r, size_t n) {
+  char buf[64];
+  char* text = n < sizeof(buf) ? buf : malloc(n + 1);
+  memcpy(text, r->src + r->pos, n);
+  text[n] = '\0';
+  lreader_advance(r, n);
+
+  errno = 0;
+  long double x = strtold(text, NULL);
+  if (text != buf) { free(text); }
+  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+static lval* lreader_symbol(lreader* r) {
+  size_t n = 0;
+  while (lreader_is_symbol(lreader_peek(r, n))) { n++; }
+
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_SYM;
+  v->sym  = malloc(n + 1);
+  memcpy(v->sym, r->src + r->pos, n);
+  v->sym[n] = '\0';
+  lreader_advance(r, n);
+  return v;
+}
+
+static lval* lreader_string(lreader* r) {
+  size_t n = 1;
+  for (;;) {
+    int c = lreader_peek(r, n);
+    if (c == EOF) {
+      lreader_advance(r, n);
+      return lreader_error(r, "'\"'");
+    }
+    if (c == '"') { break; }
+    n += (c == '\\' && lreader_peek(r, n + 1) != EOF) ? 2 : 1;
+  }
+
+  char* raw = malloc(n);
+  memcpy(raw, r->src + r->pos + 1, n - 1);
+  raw[n - 1] = '\0';
+  lreader_advance(r, n + 1);
+
+  char* unescaped = mpcf_unescape(raw);
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->str  = unescaped;
+  return v;
+}
+
+lval* lreader_expr(lreader* r);
+
+static lval* lreader_list(lreader* r, lval* x, char close) {
+  x->file = r->file;
+  x->line = r->row + 1;
+  lreader_advance(r, 1);
+  for (;;) {
+    lreader_skip(r);
+    int c = lreader_peek(r, 0);
+
+    if (c == close) {
+      lreader_advance(r, 1);
+      return x;
+    }
+    if (c == EOF || c == ')' || c == '}') {
+      lval_del(x);
+      return lreader_error(r, close == ')'
+          ? "number, symbol, string, comment, '(', '{' or ')'"
+          : "number, symbol, string, comment, '(', '{' or '}'");
+    }
+
+    lval* y = lreader_expr(r);
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      return y;
+    }
+    x = lval_add(x, y);
+  }
+}
+
+/* Read the expression at the cursor, which must not be whitespace or a comment */
+lval* lreader_expr(lreader* r) {
+  int c = lreader_peek(r, 0);
+  size_t n;
+
+  if (c == '(') { return lreader_list(r, lval_sexpr(), ')'); }
+  if (c == '{') { return lreader_list(r, lval_qexpr(), '}'); }
+  if (c == '"') { return lreader_string(r); }
+  if ((n = lreader_number_len(r))) { return lreader_number(r, n); }
+  if (lreader_is_symbol(c)) { return lreader_symbol(r); }
+
+  return lreader_error(r, "number, symbol, string, comment, '(' or '{'");
+}
+
+/* Read every expression of the source into an S-Expression, or an Error */
+lval* lreader_read_all(lreader* r) {
+  lval* x = lval_sexpr();
+  for (;;) {
+    lreader_skip(r);
+    if (lreader_peek(r, 0) == EOF) { return x; }
+
+    lval* y = lreader_expr(r);
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      return y;
+    }
+    x = lval_add(x, y);
+  }
+}
+
+lval* lval_read_string(hisp* h, char* filename, const char* src, size_t len) {
+  if (hisp_mpc_reader) {
+    hisp_grammar_init(h);
+    mpc_result_t r;
+    int ok = mpc_ctx_nparse(h->ctx, filename, src, len, h->Hisp, &r);
+    return lval_read_mpc(h, &r, ok);
+  }
+
+  lreader r;
+  lreader_init(&r, filename, src, len);
+  return lreader_read_all(&r);
+}
+
+/* Contents of a source file, either mapped into memory or read into a buffer */
+typedef struct {
+  char* src;
+  size_t len;
+  int mapped;
+} lsource;
+
+/*
+** Regular files are memory-mapped so that reading them is limited by memory
+** bandwidth rather than stdio calls. Anything that cannot be mapped, such as
+** a pipe or a terminal, is streamed into a growing buffer instead. Gives 1 for
+** a source read whole, 0 if it could not be opened and -1 if reading it failed,
+** with errno set.
+*/
+int lsource_open(lsource* s, char* filename) {
+  int fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO) : open(filename, O_RDONLY);
+  if (fd < 0) { return 0; }
+
+  struct stat st;
+  s->src = NULL;
+  s->len = 0;
+  s->mapped = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      posix_madvise(m, st.st_size, POSIX_MADV_SEQUENTIAL);
+      s->src = m;
+      s->len = st.st_size;
+      s->mapped = 1;
+      close(fd);
+      return 1;
+    }
+  }
+
+  size_t slots = 4096;
+  ssize_t got;
+  s->src = malloc(slots);
+  while ((got = read(fd, s->src + s->len, slots - s->len)) != 0) {
+    if (got < 0) {
+      if (errno == EINTR) { continue; }
+      int err = errno;
+      free(s->src);
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    s->len += got;
+    if (s->len == slots) {
+      slots *= 2;
+      s->src = realloc(s->src, slots);
+    }
+  }
+  close(fd);
+  return 1;
+}
+
+void lsource_close(lsource* s) {
+  if (s->mapped) {
+    munmap(s->src, s->len);
+  } else {
+    free(s->src);
+  }
+}
+
+lval* lcache_read(const char* src, size_t len);
+void lcache_write(const char* src, size_t len, lval* x);
+
+/* Read a whole source file, where "-" stands for the standard input */
+lval* lval_read_file(hisp* h, char* filename) {
+  int is_stdin = strcmp(filename, "-") == 0;
+  lsource s;
+
+  /* mpc reads pipes itself, and reports files that cannot be opened */
+  int opened = hisp_mpc_reader && is_stdin ? 0 : lsource_open(&s, filename);
+  if (opened < 0) {
+    return lval_err("%s: error: %s", filename, strerror(errno));
+  }
+  if (hisp_mpc_reader && opened == 0) {
+    hisp_grammar_init(h);
+    mpc_result_t r;
+    int ok = is_stdin
+      ? mpc_parse_pipe("<stdin>", stdin, h->Hisp, &r)
+      : mpc_parse_contents(filename, h->Hisp, &r);
+    return lval_read_mpc(h, &r, ok);
   }
 
+  if (opened == 0) {
+    return lval_err("%s: error: Unable to open file!", filename);
+  }
+
+  lval* x = lcache_read(s.src, s.len);
+  if (x == NULL) {
+    x = lval_read_string(h, is_stdin ? "<stdin>" : filename, s.src, s.len);
+    lcache_write(s.src, s.len, x);
+  }
+  lsource_close(&s);
   return x;
 }
 
@@ -672,60 +1473,1704 @@ lval* builtin_init(lenv* e, lval* a) {
   return x;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+/* Sorting keys, one per element, pointing back at the original cell */
+typedef struct {
+  long double num;
+  char* str;
+  int index;
+} lsort_key;
+
+/* Below this many elements the sort stays on the calling thread */
+#define LSORT_PARALLEL_MIN 65536
+#define LSORT_MAX_THREADS  8
+#define LSORT_INSERTION    16
+
+static int lsort_less(lsort_key* a, lsort_key* b, int by_str) {
+  if (by_str) {
+    return strcmp(a->str, b->str) < 0;
+  }
+  return a->num < b->num;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+/* Merge the sorted runs [0, mid) and [mid, n) of 'k' into 'out' */
+static void lsort_merge(lsort_key* k, int mid, int n, lsort_key* out, int by_str) {
+  int i = 0, j = mid, o = 0;
+  while (i < mid && j < n) {
+    // take from the right run only when strictly less, keeping the sort stable
+    if (lsort_less(&k[j], &k[i], by_str)) {
+      out[o++] = k[j++];
+    } else {
+      out[o++] = k[i++];
+    }
+  }
+  while (i < mid) { out[o++] = k[i++]; }
+  while (j < n)   { out[o++] = k[j++]; }
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* Stable merge sort of 'k' using 'tmp' as scratch space of the same size */
+static void lsort_keys(lsort_key* k, lsort_key* tmp, int n, int by_str) {
+  if (n <= LSORT_INSERTION) {
+    for (int i = 1; i < n; i++) {
+      lsort_key x = k[i];
+      int j = i - 1;
+      while (j >= 0 && lsort_less(&x, &k[j], by_str)) {
+        k[j + 1] = k[j];
+        j--;
+      }
+      k[j + 1] = x;
+    }
+    return;
+  }
+
+  int mid = n / 2;
+  lsort_keys(k, tmp, mid, by_str);
+  lsort_keys(k + mid, tmp + mid, n - mid, by_str);
+
+  // runs already in order, nothing to merge
+  if (!lsort_less(&k[mid], &k[mid - 1], by_str)) {
+    return;
+  }
+
+  lsort_merge(k, mid, n, tmp, by_str);
+  memcpy(k, tmp, sizeof(lsort_key) * n);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+typedef struct {
+  lsort_key* k;
+  lsort_key* tmp;
+  int mid;
+  int n;
+  int by_str;
+} lsort_job;
+
+static void* lsort_sort_job(void* arg) {
+  lsort_job* j = arg;
+  lsort_keys(j->k, j->tmp, j->n, j->by_str);
+  return NULL;
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-  return builtin_op(e, a, "%");
+static void* lsort_merge_job(void* arg) {
+  lsort_job* j = arg;
+  lsort_merge(j->k, j->mid, j->n, j->tmp, j->by_str);
+  memcpy(j->k, j->tmp, sizeof(lsort_key) * j->n);
+  return NULL;
 }
 
-lval* builtin_pow(lenv* e, lval* a) {
-  return builtin_op(e, a, "^");
+static int lsort_threads(int n) {
+  if (n < LSORT_PARALLEL_MIN) { return 1; }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int t = cpus > 1 ? (int)cpus : 1;
+  if (t > LSORT_MAX_THREADS) { t = LSORT_MAX_THREADS; }
+  while (t > 1 && n / t < LSORT_PARALLEL_MIN / 4) { t--; }
+  return t;
 }
 
-lval* builtin_var(lenv* e, lval* a, char* fn) {
-  LASSERT_TYPE(fn, a, 0, LVAL_QEXPR);
+/* Run 'job' on 'n' jobs in parallel, falling back to the calling thread if a thread cannot start */
+static void lsort_run(void* (*job)(void*), lsort_job* jobs, int n) {
+  pthread_t threads[LSORT_MAX_THREADS];
+  int started[LSORT_MAX_THREADS];
 
-  lval* syms = a->cell[0];
+  for (int i = 0; i < n; i++) {
+    started[i] = pthread_create(&threads[i], NULL, job, &jobs[i]) == 0;
+    if (!started[i]) { job(&jobs[i]); }
+  }
+  for (int i = 0; i < n; i++) {
+    if (started[i]) { pthread_join(threads[i], NULL); }
+  }
+}
 
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM, 
-        "Function '%s' cannot define non-symbol. Got %s, Expected %s",
-        fn, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+/* Sort the keys, splitting large inputs into runs sorted and then merged pairwise on threads */
+static void lsort_sort(lsort_key* k, int n, int by_str) {
+  lsort_key* tmp = malloc(sizeof(lsort_key) * (n ? n : 1));
+  int t = lsort_threads(n);
+
+  if (t == 1) {
+    lsort_keys(k, tmp, n, by_str);
+    free(tmp);
+    return;
   }
 
-  LASSERT(a, syms->count == (a->count - 1),
-    "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
-    fn, syms->count, a->count - 1);
+  int bounds[LSORT_MAX_THREADS + 1];
+  lsort_job jobs[LSORT_MAX_THREADS];
 
-  for (int i = 0; i < syms->count; i++) {
-    if (strcmp(fn, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i + 1]);
+  for (int i = 0; i <= t; i++) {
+    bounds[i] = (int)((long long)n * i / t);
+  }
+
+  for (int i = 0; i < t; i++) {
+    lsort_job j = { k + bounds[i], tmp + bounds[i], 0, bounds[i + 1] - bounds[i], by_str };
+    jobs[i] = j;
+  }
+  lsort_run(lsort_sort_job, jobs, t);
+
+  // merge neighbouring runs until a single run remains
+  for (int runs = t; runs > 1; runs = (runs + 1) / 2) {
+    int merges = 0;
+    for (int i = 0; i + 1 < runs; i += 2) {
+      int lo = bounds[i], mid = bounds[i + 1], hi = bounds[i + 2];
+      lsort_job j = { k + lo, tmp + lo, mid - lo, hi - lo, by_str };
+      jobs[merges++] = j;
     }
-    if (strcmp(fn, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    lsort_run(lsort_merge_job, jobs, merges);
+
+    for (int i = 0; i <= (runs + 1) / 2; i++) {
+      bounds[i] = bounds[i * 2 < runs ? i * 2 : runs];
     }
   }
 
-  lval_del(a);
-  return lval_sexpr();
+  free(tmp);
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
+/* Sort the cells of 'list' by 'keys' (Numbers or Strings) and return it as a new Q-Expression */
+static lval* lval_sort_by_keys(char* fn, lval* list, lval* keys) {
+  int by_str = list->count && keys->cell[0]->type == LVAL_STR;
+
+  for (int i = 0; i < keys->count; i++) {
+    int t = keys->cell[i]->type;
+    if (t != LVAL_NUM && t != LVAL_STR) {
+      return lval_err("Function '%s' cannot sort by %s. Expected %s or %s",
+          fn, ltype_name(t), ltype_name(LVAL_NUM), ltype_name(LVAL_STR));
+    }
+    if ((t == LVAL_STR) != by_str) {
+      return lval_err("Function '%s' cannot compare %s with %s",
+          fn, ltype_name(keys->cell[0]->type), ltype_name(t));
+    }
+  }
+
+  lsort_key* k = malloc(sizeof(lsort_key) * (list->count ? list->count : 1));
+  for (int i = 0; i < list->count; i++) {
+    k[i].num   = by_str ? 0 : keys->cell[i]->num;
+    k[i].str   = by_str ? keys->cell[i]->str : NULL;
+    k[i].index = i;
+  }
+
+  lsort_sort(k, list->count, by_str);
+
+  lval* x = lval_qexpr();
+  x->count = list->count;
+  x->cell  = malloc(sizeof(lval*) * (x->count ? x->count : 1));
+  for (int i = 0; i < x->count; i++) {
+    x->cell[i] = list->cell[k[i].index];
+  }
+  free(k);
+
+  // cells now belong to 'x'
+  list->count = 0;
+  return x;
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+  LASSERT_NUM("sort", a, 1);
+  LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+
+  lval* list = a->cell[0];
+  lval* x = lval_sort_by_keys("sort", list, list);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_sort_by(lenv* e, lval* a) {
+  LASSERT_NUM("sort-by", a, 2);
+  LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+  LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+  lval* f    = a->cell[0];
+  lval* list = a->cell[1];
+
+  // compute every key once, calling a fresh copy of 'f' as calls consume formals
+  lval* keys = lval_qexpr();
+  for (int i = 0; i < list->count; i++) {
+    lval* args = lval_add(lval_sexpr(), lval_copy(list->cell[i]));
+    lval* g    = lval_copy(f);
+    lval* key  = lval_call(e, g, args);
+    lval_del(g);
+
+    if (key->type == LVAL_ERR) {
+      lval_del(keys);
+      lval_del(a);
+      return key;
+    }
+    keys = lval_add(keys, key);
+  }
+
+  lval* x = lval_sort_by_keys("sort-by", list, keys);
+  lval_del(keys);
+  lval_del(a);
+  return x;
+}
+
+/*
+** Worker pool
+**
+** pmap, pfilter and preduce run their function over ranges of a list on a
+** pool of worker threads. Each worker owns a deque of ranges. While the range
+** it is running is bigger than the job's grain it splits it in half, pushing
+** the upper half on the bottom of its deque, and it takes work back from the
+** bottom. Idle threads steal from the top of other deques, where the biggest
+** ranges are, so ranges are only split as far as the load needs.
+**
+** Deque 0 is shared by threads outside the pool, which help run tasks while
+** they wait for their own job to finish. The function of a job is called on
+** several threads at once, reading the environment it was called from, so it
+** must be pure: it may not define globals or load files.
+*/
+
+typedef struct ljob ljob;
+
+struct ljob {
+  /* Run the elements [lo, hi) of the job */
+  void (*run)(ljob* j, int lo, int hi);
+  /* If set, called once every element has run. The job is not used after */
+  void (*finish)(ljob* j);
+  int grain;
+  /* Elements not yet run, guarded by the pool lock */
+  int pending;
+
+  lenv* env;
+  lval* f;
+  lval** cells;
+  lval** out;
+  int* ends;
+};
+
+typedef struct {
+  ljob* job;
+  int lo;
+  int hi;
+} ltask;
+
+typedef struct {
+  pthread_mutex_t lock;
+  ltask* tasks;
+  /* Thieves take from 'top', the owner pushes and takes at 'bottom' */
+  int top;
+  int bottom;
+  int slots;
+} ldeque;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  /* Threads running jobs, counting the thread that is waiting on one */
+  int workers;
+  int queued;
+  int sleeping;
+  ldeque* deques;
+} lpool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* The deque of the current thread */
+static __thread int lpool_self = 0;
+
+static int lpool_workers(void) {
+  int n = hisp_workers;
+  if (n <= 0 && getenv("HISP_WORKERS")) { n = atoi(getenv("HISP_WORKERS")); }
+  if (n <= 0) { n = (int)sysconf(_SC_NPROCESSORS_ONLN); }
+  return n > 0 ? n : 1;
+}
+
+static void lpool_push(int self, ltask t) {
+  ldeque* d = &lpool.deques[self];
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->slots) {
+    if (d->top > 0) {
+      memmove(d->tasks, d->tasks + d->top, sizeof(ltask) * (d->bottom - d->top));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      d->slots = d->slots ? d->slots * 2 : 64;
+      d->tasks = realloc(d->tasks, sizeof(ltask) * d->slots);
+    }
+  }
+  d->tasks[d->bottom++] = t;
+  pthread_mutex_unlock(&d->lock);
+
+  pthread_mutex_lock(&lpool.lock);
+  lpool.queued++;
+  if (lpool.sleeping) { pthread_cond_broadcast(&lpool.wake); }
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+/* Take the newest task of deque 'i', or with 'steal' its oldest */
+static int lpool_pop(int i, int steal, ltask* t) {
+  ldeque* d = &lpool.deques[i];
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom) {
+    *t = steal ? d->tasks[d->top++] : d->tasks[--d->bottom];
+    if (d->top == d->bottom) { d->top = d->bottom = 0; }
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int lpool_take(int self, ltask* t) {
+  int found = lpool_pop(self, 0, t);
+  for (int i = 1; i < lpool.workers && !found; i++) {
+    found = lpool_pop((self + i) % lpool.workers, 1, t);
+  }
+  if (found) {
+    pthread_mutex_lock(&lpool.lock);
+    lpool.queued--;
+    pthread_mutex_unlock(&lpool.lock);
+  }
+  return found;
+}
+
+static void lpool_run_task(int self, ltask t) {
+  while (t.hi - t.lo > t.job->grain) {
+    int mid = t.lo + (t.hi - t.lo) / 2;
+    ltask upper = { t.job, mid, t.hi };
+    lpool_push(self, upper);
+    t.hi = mid;
+  }
+  t.job->run(t.job, t.lo, t.hi);
+
+  // once pending is zero a waiting thread may return and free the job
+  void (*finish)(ljob*) = NULL;
+  pthread_mutex_lock(&lpool.lock);
+  t.job->pending -= t.hi - t.lo;
+  if (t.job->pending == 0) {
+    finish = t.job->finish;
+    pthread_cond_broadcast(&lpool.wake);
+  }
+  pthread_mutex_unlock(&lpool.lock);
+
+  if (finish) { finish(t.job); }
+}
+
+static void* lpool_worker(void* arg) {
+  lpool_self = (int)(long)arg;
+  for (;;) {
+    ltask t;
+    if (lpool_take(lpool_self, &t)) {
+      lpool_run_task(lpool_self, t);
+      continue;
+    }
+    pthread_mutex_lock(&lpool.lock);
+    while (lpool.queued == 0) {
+      lpool.sleeping++;
+      pthread_cond_wait(&lpool.wake, &lpool.lock);
+      lpool.sleeping--;
+    }
+    pthread_mutex_unlock(&lpool.lock);
+  }
+  return NULL;
+}
+
+/* Start the pool the first time it is used. Its threads live as long as the process */
+static void lpool_start(void) {
+  pthread_mutex_lock(&lpool.lock);
+  if (!lpool.started) {
+    lpool.workers = lpool_workers();
+    lpool.deques = calloc(lpool.workers, sizeof(ldeque));
+    for (int i = 0; i < lpool.workers; i++) {
+      pthread_mutex_init(&lpool.deques[i].lock, NULL);
+    }
+    for (int i = 1; i < lpool.workers; i++) {
+      pthread_t t;
+      if (pthread_create(&t, NULL, lpool_worker, (void*)(long)i) == 0) {
+        pthread_detach(t);
+      }
+    }
+    lpool.started = 1;
+  }
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+/* Help run queued tasks until '*pending', read under the pool lock, is zero */
+static void lpool_wait(int* pending) {
+  lpool_start();
+  for (;;) {
+    ltask t;
+    if (lpool_take(lpool_self, &t)) {
+      lpool_run_task(lpool_self, t);
+      continue;
+    }
+    pthread_mutex_lock(&lpool.lock);
+    while (*pending > 0 && lpool.queued == 0) {
+      lpool.sleeping++;
+      pthread_cond_wait(&lpool.wake, &lpool.lock);
+      lpool.sleeping--;
+    }
+    int done = *pending == 0;
+    pthread_mutex_unlock(&lpool.lock);
+    if (done) { return; }
+  }
+}
+
+/* Queue the 'n' elements of 'j', or run them straight away when there are no workers */
+static void lpool_submit(ljob* j, int n) {
+  lpool_start();
+  j->grain = n / (lpool.workers * 8);
+  if (j->grain < 1) { j->grain = 1; }
+  j->pending = n;
+
+  ltask root = { j, 0, n };
+  if (lpool.workers == 1) {
+    j->grain = n;
+    lpool_run_task(lpool_self, root);
+  } else {
+    lpool_push(lpool_self, root);
+  }
+}
+
+/* Run all 'n' elements of 'j', helping with queued tasks until they are done */
+static void lpool_run(ljob* j, int n) {
+  if (n == 0) { return; }
+  lpool_submit(j, n);
+  lpool_wait(&j->pending);
+}
+
+/* Call a fresh copy of the job's function, as calls consume its formals */
+static lval* ljob_call(ljob* j, lval* args) {
+  lval* g = lval_copy(j->f);
+  lval* x = lval_call(j->env, g, args);
+  lval_del(g);
+  return x;
+}
+
+static void ljob_map(ljob* j, int lo, int hi) {
+  for (int i = lo; i < hi; i++) {
+    j->out[i] = ljob_call(j, lval_add(lval_sexpr(), j->cells[i]));
+  }
+}
+
+static void ljob_filter(ljob* j, int lo, int hi) {
+  for (int i = lo; i < hi; i++) {
+    j->out[i] = ljob_call(j, lval_add(lval_sexpr(), lval_copy(j->cells[i])));
+  }
+}
+
+/* Fold the range from its first element, leaving the result at out[lo] */
+static void ljob_reduce(ljob* j, int lo, int hi) {
+  lval* acc = j->cells[lo];
+  for (int i = lo + 1; i < hi; i++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(j->cells[i]);
+    } else {
+      acc = ljob_call(j, lval_add(lval_add(lval_sexpr(), acc), j->cells[i]));
+    }
+  }
+  j->out[lo] = acc;
+  j->ends[lo] = hi;
+}
+
+/* The first Error of 'n' results, deleting all the others, or NULL if there is none */
+static lval* ljob_first_err(lval** out, int n) {
+  lval* err = NULL;
+  for (int i = 0; i < n; i++) {
+    if (err == NULL && out[i]->type == LVAL_ERR) {
+      err = out[i];
+    }
+  }
+  if (err == NULL) { return NULL; }
+  for (int i = 0; i < n; i++) {
+    if (out[i] != err) { lval_del(out[i]); }
+  }
+  return err;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  lval* list = a->cell[1];
+  int n = list->count;
+  ljob j = { ljob_map, NULL, 1, 0, e, a->cell[0], list->cell, NULL, NULL };
+  j.out = malloc(sizeof(lval*) * (n ? n : 1));
+  lpool_run(&j, n);
+
+  // the elements were passed on to the calls
+  list->count = 0;
+  lval_del(a);
+
+  lval* err = ljob_first_err(j.out, n);
+  if (err) {
+    free(j.out);
+    return err;
+  }
+
+  lval* x = lval_qexpr();
+  x->count = n;
+  x->cell  = j.out;
+  return x;
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+  LASSERT_NUM("pfilter", a, 2);
+  LASSERT_TYPE("pfilter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pfilter", a, 1, LVAL_QEXPR);
+
+  lval* list = a->cell[1];
+  int n = list->count;
+  ljob j = { ljob_filter, NULL, 1, 0, e, a->cell[0], list->cell, NULL, NULL };
+  j.out = malloc(sizeof(lval*) * (n ? n : 1));
+  lpool_run(&j, n);
+
+  for (int i = 0; i < n; i++) {
+    if (j.out[i]->type != LVAL_ERR && j.out[i]->type != LVAL_NUM) {
+      lval* err = lval_err("Function 'pfilter' passed a function returning %s. Expected %s",
+          ltype_name(j.out[i]->type), ltype_name(LVAL_NUM));
+      lval_del(j.out[i]);
+      j.out[i] = err;
+    }
+  }
+
+  lval* err = ljob_first_err(j.out, n);
+  if (err) {
+    free(j.out);
+    lval_del(a);
+    return err;
+  }
+
+  // keep the elements the function was true for, in order
+  lval* x = lval_qexpr();
+  x->cell = malloc(sizeof(lval*) * (n ? n : 1));
+  for (int i = 0; i < n; i++) {
+    if (j.out[i]->num) {
+      x->cell[x->count++] = list->cell[i];
+    } else {
+      lval_del(list->cell[i]);
+    }
+    lval_del(j.out[i]);
+  }
+  free(j.out);
+
+  list->count = 0;
+  lval_del(a);
+  return x;
+}
+
+/*
+ * Ranges are folded in parallel and then their results folded from the
+ * initial value in order, so this is foldl for an associative function.
+ */
+lval* builtin_preduce(lenv* e, lval* a) {
+  LASSERT_NUM("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+
+  lval* list = a->cell[2];
+  int n = list->count;
+  ljob j = { ljob_reduce, NULL, 1, 0, e, a->cell[0], list->cell, NULL, NULL };
+  j.out  = malloc(sizeof(lval*) * (n ? n : 1));
+  j.ends = malloc(sizeof(int) * (n ? n : 1));
+  lpool_run(&j, n);
+  list->count = 0;
+
+  lval* acc = lval_pop(a, 1);
+  for (int i = 0; i < n; i = j.ends[i]) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(j.out[i]);
+    } else if (j.out[i]->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = j.out[i];
+    } else {
+      acc = ljob_call(&j, lval_add(lval_add(lval_sexpr(), acc), j.out[i]));
+    }
+  }
+
+  free(j.out);
+  free(j.ends);
+  lval_del(a);
+  return acc;
+}
+
+/*
+** Futures
+**
+** A future evaluates a Q-Expression as a job of the worker pool, in copies of
+** the local environments it was made in and the shared global environment.
+** Copies of a future share it and count references to it. Awaiting takes the
+** result over when nothing else refers to the future, and copies it otherwise.
+** With a single worker, futures are evaluated as soon as they are made.
+*/
+
+struct lfuture {
+  ljob job;
+  hisp* owner;
+  lval* expr;
+  lval* result;
+  /* Guarded by the pool lock. The running job holds a reference */
+  int running;
+  int refs;
+};
+
+/* Copy the local environments of 'e', sharing the global environment */
+static lenv* lenv_capture(lenv* e) {
+  if (e->par == NULL) { return e; }
+  lenv* c = lenv_copy(e);
+  c->par = lenv_capture(e->par);
+  return c;
+}
+
+static void lenv_release(lenv* e) {
+  while (e->par) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+}
+
+static void lfuture_free(lfuture* fu) {
+  if (fu->result) { lval_del(fu->result); }
+  free(fu);
+}
+
+void lfuture_retain(lfuture* fu) {
+  pthread_mutex_lock(&lpool.lock);
+  fu->refs++;
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+void lfuture_release(lfuture* fu) {
+  pthread_mutex_lock(&lpool.lock);
+  int unused = --fu->refs == 0;
+  pthread_mutex_unlock(&lpool.lock);
+  if (unused) { lfuture_free(fu); }
+}
+
+static void lfuture_run(ljob* j, int lo, int hi) {
+  lfuture* fu = (lfuture*)j;
+  fu->result = lval_eval(j->env, fu->expr);
+  fu->expr = NULL;
+  lenv_release(j->env);
+}
+
+static void lfuture_finish(ljob* j) {
+  lfuture* fu = (lfuture*)j;
+  pthread_mutex_lock(&lpool.lock);
+  fu->running = 0;
+  fu->owner->futures--;
+  int unused = --fu->refs == 0;
+  pthread_cond_broadcast(&lpool.wake);
+  pthread_mutex_unlock(&lpool.lock);
+  if (unused) { lfuture_free(fu); }
+}
+
+/* Wait for the future of 'v' and take its result, or a copy if the future is shared */
+static lval* lfuture_await(lval* v) {
+  lfuture* fu = v->future;
+  lpool_wait(&fu->running);
+
+  pthread_mutex_lock(&lpool.lock);
+  int shared = fu->refs > 1;
+  pthread_mutex_unlock(&lpool.lock);
+
+  if (shared) { return lval_copy(fu->result); }
+  lval* x = fu->result;
+  fu->result = NULL;
+  return x;
+}
+
+/* A running future of the interpreter 'owner', referred to by its result and one handle */
+static lfuture* lfuture_new(hisp* owner) {
+  lfuture* fu = calloc(1, sizeof(lfuture));
+  fu->job.finish = lfuture_finish;
+  fu->owner   = owner;
+  fu->running = 1;
+  fu->refs    = 2;
+
+  pthread_mutex_lock(&lpool.lock);
+  owner->futures++;
+  pthread_mutex_unlock(&lpool.lock);
+  return fu;
+}
+
+/* Give a future that is not run as a job its result */
+static void lfuture_resolve(lfuture* fu, lval* x) {
+  fu->result = x;
+  lfuture_finish(&fu->job);
+}
+
+lval* lval_future(lfuture* fu) {
+  lval* v = malloc(sizeof(lval));
+  v->type   = LVAL_FUT;
+  v->future = fu;
+  return v;
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+  LASSERT_NUM("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  lfuture* fu = lfuture_new(lenv_hisp(e));
+  fu->job.run = lfuture_run;
+  fu->expr    = lval_take(a, 0);
+  fu->expr->type = LVAL_SEXPR;
+  fu->job.env = lenv_capture(e);
+
+  lval* v = lval_future(fu);
+  lpool_submit(&fu->job, 1);
+  return v;
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUT);
+
+  lval* x = lfuture_await(a->cell[0]);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_await_all(lenv* e, lval* a) {
+  LASSERT_NUM("await-all", a, 1);
+  LASSERT_TYPE("await-all", a, 0, LVAL_QEXPR);
+
+  lval* list = a->cell[0];
+  for (int i = 0; i < list->count; i++) {
+    LASSERT(a, list->cell[i]->type == LVAL_FUT,
+        "Function 'await-all' passed %s in its list. Expected %s",
+        ltype_name(list->cell[i]->type), ltype_name(LVAL_FUT));
+  }
+
+  int n = list->count;
+  lval** out = malloc(sizeof(lval*) * (n > 0 ? n : 1));
+  for (int i = 0; i < n; i++) {
+    out[i] = lfuture_await(list->cell[i]);
+  }
+  lval_del(a);
+
+  lval* err = ljob_first_err(out, n);
+  if (err) {
+    free(out);
+    return err;
+  }
+
+  lval* x = lval_qexpr();
+  x->count = n;
+  x->cell  = out;
+  return x;
+}
+
+/*
+** Green threads
+**
+** spawn runs a Q-Expression as a green thread: a coroutine with a C stack of
+** its own, so the recursive evaluator can be suspended anywhere in it and
+** resumed later. Green threads belong to the OS thread that spawned them and
+** only switch when one blocks on a channel, a descriptor or a sleep, or
+** yields. They run while the main evaluation is blocked or yields, and main
+** runs the rest after each script and REPL line.
+**
+** Channels are bounded queues of values. send moves its value in, waiting
+** while the channel is full, and recv takes the oldest value out, waiting
+** while it is empty.
+*/
+
+/* As big as a main thread's usual stack. Pages are only used once touched */
+#define LGREEN_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct lgreen lgreen;
+
+struct lgreen {
+  ucontext_t ctx;
+  char* stack;
+  lenv* env;
+  lval* expr;
+  int done;
+  /* Its calls, while profiling */
+  lprof_stack* prof;
+  /* When a sleeping green thread is due, in milliseconds of lio_now */
+  long long wake;
+  /* Next in the run queue, the queue of the channel it waits on, or the sleepers */
+  lgreen* next;
+};
+
+typedef struct {
+  lgreen* head;
+  lgreen* tail;
+} lgreen_queue;
+
+struct lchan {
+  /* A ring of 'size' slots, grown as items arrive up to the capacity 'cap' */
+  lval** items;
+  int size;
+  int cap;
+  int count;
+  int first;
+  /* Guarded by the pool lock, as copies can be made on any thread */
+  int refs;
+  /* The OS thread that made it, the only one whose green threads may use it */
+  pthread_t owner;
+  lgreen_queue senders;
+  lgreen_queue receivers;
+};
+
+static __thread struct {
+  /* Where a green thread returns to when it blocks, yields or ends */
+  ucontext_t main;
+  /* The green thread running, NULL while the main evaluation is */
+  lgreen* current;
+  lgreen_queue runnable;
+  /* The event loop's epoll instance, made by the first wait on a descriptor */
+  int epoll;
+  int epoll_made;
+  /* Green threads waiting on a descriptor, and those sleeping, soonest first */
+  int io_waiting;
+  lgreen* sleeping;
+  /* What the main evaluation waits on in the event loop */
+  int main_ready;
+  long long main_wake;
+} lsched;
+
+static void lgreen_push(lgreen_queue* q, lgreen* g) {
+  g->next = NULL;
+  if (q->tail) { q->tail->next = g; } else { q->head = g; }
+  q->tail = g;
+}
+
+static lgreen* lgreen_pop(lgreen_queue* q) {
+  lgreen* g = q->head;
+  if (g) {
+    q->head = g->next;
+    if (q->head == NULL) { q->tail = NULL; }
+  }
+  return g;
+}
+
+static void lgreen_entry(void) {
+  lgreen* g = lsched.current;
+  lval* x = lval_eval(g->env, g->expr);
+  // nothing waits for a green thread, so its errors are printed like a script's
+  if (x->type == LVAL_ERR) { lval_println(lenv_out(g->env), x); }
+  lval_del(x);
+  lenv_release(g->env);
+  g->done = 1;
+}
+
+/* Run the next runnable green thread until it blocks, yields or ends. Zero if there is none */
+static int lgreen_step(void) {
+  lgreen* g = lgreen_pop(&lsched.runnable);
+  if (g == NULL) { return 0; }
+
+  lprof_stack* prof = lprof_current;
+  lsched.current = g;
+  lprof_current = g->prof;
+  swapcontext(&lsched.main, &g->ctx);
+  lsched.current = NULL;
+  lprof_current = prof;
+
+  if (g->done) {
+    munmap(g->stack, LGREEN_STACK_SIZE);
+    free(g->prof);
+    free(g);
+  }
+  return 1;
+}
+
+static long long lio_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static int lio_busy(void) {
+  return lsched.io_waiting || lsched.sleeping;
+}
+
+/*
+ * Make the green threads whose descriptor is ready or whose sleep is over
+ * runnable, and note whether what main waits on is. With 'block' set, first
+ * wait until at least one of them is.
+ */
+static void lio_poll(int block) {
+  long long now = lio_now();
+  long long next = lsched.sleeping ? lsched.sleeping->wake : 0;
+  if (lsched.main_wake && (next == 0 || lsched.main_wake < next)) {
+    next = lsched.main_wake;
+  }
+
+  int timeout = 0;
+  if (block) {
+    if (next == 0) {
+      timeout = -1;
+    } else if (next > now) {
+      timeout = next - now < INT_MAX ? (int)(next - now) : INT_MAX;
+    }
+  }
+
+  if (lsched.epoll_made) {
+    struct epoll_event ready[64];
+    int n = epoll_wait(lsched.epoll, ready, 64, timeout);
+    for (int i = 0; i < n; i++) {
+      lgreen* g = ready[i].data.ptr;
+      if (g == NULL) {
+        lsched.main_ready = 1;
+      } else {
+        lsched.io_waiting--;
+        lgreen_push(&lsched.runnable, g);
+      }
+    }
+  } else if (timeout > 0) {
+    struct timespec t = { timeout / 1000, (timeout % 1000) * 1000000L };
+    nanosleep(&t, NULL);
+  }
+
+  now = lio_now();
+  while (lsched.sleeping && lsched.sleeping->wake <= now) {
+    lgreen* g = lsched.sleeping;
+    lsched.sleeping = g->next;
+    lgreen_push(&lsched.runnable, g);
+  }
+  if (lsched.main_wake && lsched.main_wake <= now) {
+    lsched.main_wake = 0;
+    lsched.main_ready = 1;
+  }
+}
+
+/*
+ * Run green threads until none is runnable or waiting on a descriptor or a
+ * sleep. Does nothing inside a green thread
+ */
+void lgreen_run(void) {
+  if (lsched.current) { return; }
+  for (;;) {
+    int ran = lgreen_step();
+    if (lio_busy()) {
+      lio_poll(!ran);
+    } else if (!ran) {
+      return;
+    }
+  }
+}
+
+/*
+ * Suspend the caller until something it waits for may have changed: a green
+ * thread goes on 'q' and back to main, which instead runs another green thread.
+ * Zero if the caller is main and no green thread can run or be woken by the
+ * event loop, so it would never wake.
+ */
+static int lgreen_wait(lgreen_queue* q) {
+  lgreen* g = lsched.current;
+  if (g == NULL) {
+    if (lgreen_step()) { return 1; }
+    if (!lio_busy()) { return 0; }
+    lio_poll(1);
+    return 1;
+  }
+  if (q) {
+    lgreen_push(q, g);
+  } else {
+    lgreen_push(&lsched.runnable, g);
+  }
+  swapcontext(&g->ctx, &lsched.main);
+  return 1;
+}
+
+static void lgreen_wake(lgreen_queue* q) {
+  lgreen* g = lgreen_pop(q);
+  if (g) { lgreen_push(&lsched.runnable, g); }
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT_NUM("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+  char* stack = mmap(NULL, LGREEN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    lval_del(a);
+    return lval_err("Function 'spawn' could not allocate a stack");
+  }
+  // the lowest page is left unmapped, so overflowing the stack faults
+  mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  lgreen* g = calloc(1, sizeof(lgreen));
+  g->stack = stack;
+  g->expr  = lval_take(a, 0);
+  g->expr->type = LVAL_SEXPR;
+  g->env   = lenv_capture(e);
+  g->prof  = lprof_stack_new();
+
+  getcontext(&g->ctx);
+  g->ctx.uc_stack.ss_sp   = stack;
+  g->ctx.uc_stack.ss_size = LGREEN_STACK_SIZE;
+  g->ctx.uc_link = &lsched.main;
+  makecontext(&g->ctx, lgreen_entry, 0);
+
+  lgreen_push(&lsched.runnable, g);
+  return lval_sexpr();
+}
+
+/* Let other green threads run, then return the value given, as calls need an argument */
+lval* builtin_yield(lenv* e, lval* a) {
+  LASSERT_NUM("yield", a, 1);
+  lgreen_wait(NULL);
+  return lval_take(a, 0);
+}
+
+lchan* lchan_new(int cap) {
+  lchan* c = calloc(1, sizeof(lchan));
+  c->cap = cap;
+  c->refs = 1;
+  c->owner = pthread_self();
+  return c;
+}
+
+void lchan_retain(lchan* c) {
+  pthread_mutex_lock(&lpool.lock);
+  c->refs++;
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+void lchan_release(lchan* c) {
+  pthread_mutex_lock(&lpool.lock);
+  int unused = --c->refs == 0;
+  pthread_mutex_unlock(&lpool.lock);
+  if (!unused) { return; }
+
+  for (int i = 0; i < c->count; i++) {
+    lval_del(c->items[(c->first + i) % c->size]);
+  }
+  free(c->items);
+  free(c);
+}
+
+/* Make room for one more item in a channel that is not full. Zero if out of memory */
+int lchan_reserve(lchan* c) {
+  if (c->count < c->size) { return 1; }
+
+  int size = c->size == 0 ? 4 : c->size <= c->cap / 2 ? c->size * 2 : c->cap;
+  if (size > c->cap) { size = c->cap; }
+  lval** items = malloc(sizeof(lval*) * size);
+  if (items == NULL) { return 0; }
+
+  for (int i = 0; i < c->count; i++) {
+    items[i] = c->items[(c->first + i) % c->size];
+  }
+  free(c->items);
+  c->items = items;
+  c->size  = size;
+  c->first = 0;
+  return 1;
+}
+
+/* Add an item to a channel with room for it */
+void lchan_put(lchan* c, lval* v) {
+  c->items[(c->first + c->count++) % c->size] = v;
+}
+
+lval* lval_chan(lchan* c) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_CHAN;
+  v->chan = c;
+  return v;
+}
+
+lval* builtin_chan(lenv* e, lval* a) {
+  LASSERT_NUM("chan", a, 1);
+  LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[0]->num >= 1 && a->cell[0]->num <= INT_MAX,
+      "Function 'chan' passed capacity %Lg. Expected at least 1", a->cell[0]->num);
+
+  lchan* c = lchan_new((int)a->cell[0]->num);
+  lval_del(a);
+  return lval_chan(c);
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+  LASSERT_NUM("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  LASSERT(a, pthread_equal(c->owner, pthread_self()),
+      "Function 'send' passed a channel made on another thread");
+  while (c->count == c->cap) {
+    LASSERT(a, lgreen_wait(&c->senders),
+        "Function 'send' would wait forever on a full channel");
+  }
+
+  LASSERT(a, lchan_reserve(c), "Function 'send' ran out of memory");
+  lchan_put(c, lval_pop(a, 1));
+  lgreen_wake(&c->receivers);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+  LASSERT_NUM("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  LASSERT(a, pthread_equal(c->owner, pthread_self()),
+      "Function 'recv' passed a channel made on another thread");
+  while (c->count == 0) {
+    LASSERT(a, lgreen_wait(&c->receivers),
+        "Function 'recv' would wait forever on an empty channel");
+  }
+
+  lval* x = c->items[c->first];
+  c->first = (c->first + 1) % c->size;
+  c->count--;
+  lgreen_wake(&c->senders);
+  lval_del(a);
+  return x;
+}
+
+/*
+** Event loop
+**
+** Descriptors are numbers. Those made by open, listen, connect and accept are
+** non-blocking, and read, write and accept wait on them through an epoll event
+** loop rather than blocking the OS thread: a green thread waiting on one, or
+** in sleep, is set aside until it is ready, and other green threads run
+** meanwhile. The main evaluation waits the same way, running green threads
+** until what it waits on is ready. Only one green thread should wait on a
+** descriptor at a time.
+*/
+
+static lval* lio_err(char* fn, lval* a) {
+  lval* err = lval_err("Function '%s' failed: %s", fn, strerror(errno));
+  lval_del(a);
+  return err;
+}
+
+static int lio_prepare(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) { return -1; }
+  return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Run green threads and the event loop until what main waits on is ready */
+static void lio_block_main(void) {
+  while (!lsched.main_ready) {
+    lio_poll(!lgreen_step());
+  }
+}
+
+/* Suspend the caller until 'fd' is ready for 'events'. Nonzero, with errno set, if it cannot be watched */
+static int lio_wait(int fd, uint32_t events) {
+  if (!lsched.epoll_made) {
+    lsched.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (lsched.epoll < 0) { return -1; }
+    lsched.epoll_made = 1;
+  }
+
+  lgreen* g = lsched.current;
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = g;
+  if (epoll_ctl(lsched.epoll, EPOLL_CTL_MOD, fd, &ev) != 0
+      && (errno != ENOENT || epoll_ctl(lsched.epoll, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+    return -1;
+  }
+
+  if (g) {
+    lsched.io_waiting++;
+    swapcontext(&g->ctx, &lsched.main);
+  } else {
+    lsched.main_ready = 0;
+    lio_block_main();
+  }
+  return 0;
+}
+
+/* Suspend the caller for 'ms' milliseconds */
+static void lio_sleep(long long ms) {
+  long long wake = lio_now() + ms;
+  lgreen* g = lsched.current;
+  if (g) {
+    g->wake = wake;
+    lgreen** p = &lsched.sleeping;
+    while (*p && (*p)->wake <= wake) { p = &(*p)->next; }
+    g->next = *p;
+    *p = g;
+    swapcontext(&g->ctx, &lsched.main);
+  } else {
+    lsched.main_wake = wake;
+    lsched.main_ready = 0;
+    lio_block_main();
+  }
+}
+
+/*
+ * A descriptor hisp did not make, like stdin, may block, so wait until it is
+ * ready before using it. Regular files cannot be watched and are always ready
+ */
+static void lio_ready(int fd, uint32_t events) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0 && !(flags & O_NONBLOCK)) { lio_wait(fd, events); }
+}
+
+/* After a call on 'fd' failed, wait if it only would have blocked. Nonzero if it should be tried again */
+static int lio_again(int fd, uint32_t events) {
+  if (errno == EINTR) { return 1; }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) { return 0; }
+  return lio_wait(fd, events) == 0;
+}
+
+lval* builtin_open(lenv* e, lval* a) {
+  LASSERT_NUM("open", a, 2);
+  LASSERT_TYPE("open", a, 0, LVAL_STR);
+  LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+  char* mode = a->cell[1]->str;
+  int flags = strcmp(mode, "r") == 0 ? O_RDONLY
+    : strcmp(mode, "w") == 0 ? O_WRONLY | O_CREAT | O_TRUNC
+    : strcmp(mode, "a") == 0 ? O_WRONLY | O_CREAT | O_APPEND
+    : -1;
+  LASSERT(a, flags != -1,
+      "Function 'open' passed mode \"%s\". Expected \"r\", \"w\" or \"a\"", mode);
+
+  int fd = open(a->cell[0]->str, flags | O_CLOEXEC, 0666);
+  if (fd < 0 || lio_prepare(fd) != 0) {
+    lval* err = lio_err("open", a);
+    if (fd >= 0) { close(fd); }
+    return err;
+  }
+  lval_del(a);
+  return lval_num(fd);
+}
+
+static int lio_socket_addr(struct sockaddr_un* addr, char* path) {
+  if (strlen(path) >= sizeof(addr->sun_path)) { return 0; }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+lval* builtin_listen(lenv* e, lval* a) {
+  LASSERT_NUM("listen", a, 1);
+  LASSERT_TYPE("listen", a, 0, LVAL_STR);
+
+  char* path = a->cell[0]->str;
+  struct sockaddr_un addr;
+  LASSERT(a, lio_socket_addr(&addr, path),
+      "Function 'listen' passed a path too long for a socket");
+
+  /* A socket left by an earlier run would make bind fail */
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) { unlink(path); }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) { return lio_err("listen", a); }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(fd, SOMAXCONN) != 0 || lio_prepare(fd) != 0) {
+    lval* err = lio_err("listen", a);
+    close(fd);
+    return err;
+  }
+  lval_del(a);
+  return lval_num(fd);
+}
+
+lval* builtin_connect(lenv* e, lval* a) {
+  LASSERT_NUM("connect", a, 1);
+  LASSERT_TYPE("connect", a, 0, LVAL_STR);
+
+  struct sockaddr_un addr;
+  LASSERT(a, lio_socket_addr(&addr, a->cell[0]->str),
+      "Function 'connect' passed a path too long for a socket");
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) { return lio_err("connect", a); }
+  if (lio_prepare(fd) != 0) {
+    lval* err = lio_err("connect", a);
+    close(fd);
+    return err;
+  }
+  /*
+   * Local sockets connect at once or fail with EAGAIN while the listener's
+   * backlog is full, with nothing to wait on, so retry after a moment
+   */
+  while (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (errno == EAGAIN) {
+      lio_sleep(1);
+    } else if (errno != EINTR) {
+      lval* err = lio_err("connect", a);
+      close(fd);
+      return err;
+    }
+  }
+  lval_del(a);
+  return lval_num(fd);
+}
+
+lval* builtin_accept(lenv* e, lval* a) {
+  LASSERT_NUM("accept", a, 1);
+  LASSERT_FD("accept", a, 0);
+
+  int fd = a->cell[0]->num;
+  lio_ready(fd, EPOLLIN);
+  int c;
+  while ((c = accept(fd, NULL, NULL)) < 0) {
+    if (!lio_again(fd, EPOLLIN)) { return lio_err("accept", a); }
+  }
+  if (lio_prepare(c) != 0) {
+    lval* err = lio_err("accept", a);
+    close(c);
+    return err;
+  }
+  lval_del(a);
+  return lval_num(c);
+}
+
+/* Read what is available, waiting until something is. "" at end of file */
+lval* builtin_read(lenv* e, lval* a) {
+  LASSERT_NUM("read", a, 1);
+  LASSERT_FD("read", a, 0);
+
+  int fd = a->cell[0]->num;
+  char buffer[65536];
+  lio_ready(fd, EPOLLIN);
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer) - 1)) < 0) {
+    if (!lio_again(fd, EPOLLIN)) { return lio_err("read", a); }
+  }
+  /* Strings end at a NUL, so one in the data would silently cut it short */
+  LASSERT(a, memchr(buffer, '\0', n) == NULL,
+      "Function 'read' read %i bytes holding a NUL byte, which strings cannot hold", (int)n);
+  buffer[n] = '\0';
+  lval_del(a);
+  return lval_str(buffer);
+}
+
+/* Write the whole string, waiting while the descriptor is full. Returns its length */
+lval* builtin_write(lenv* e, lval* a) {
+  LASSERT_NUM("write", a, 2);
+  LASSERT_FD("write", a, 0);
+  LASSERT_TYPE("write", a, 1, LVAL_STR);
+
+  int fd = a->cell[0]->num;
+  char* s = a->cell[1]->str;
+  size_t len = strlen(s);
+  size_t done = 0;
+  lio_ready(fd, EPOLLOUT);
+  while (done < len) {
+    /* send reports a closed peer as an error rather than raising SIGPIPE */
+    ssize_t n = send(fd, s + done, len - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) { n = write(fd, s + done, len - done); }
+    if (n >= 0) {
+      done += n;
+    } else if (!lio_again(fd, EPOLLOUT)) {
+      return lio_err("write", a);
+    }
+  }
+  lval_del(a);
+  return lval_num(len);
+}
+
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_FD("close", a, 0);
+
+  if (close(a->cell[0]->num) != 0) { return lio_err("close", a); }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Wait for a number of milliseconds, letting other green threads run */
+lval* builtin_sleep(lenv* e, lval* a) {
+  LASSERT_NUM("sleep", a, 1);
+  LASSERT_TYPE("sleep", a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[0]->num >= 0 && a->cell[0]->num <= INT_MAX,
+      "Function 'sleep' passed %Lg. Expected between 0 and %i milliseconds",
+      a->cell[0]->num, INT_MAX);
+
+  lio_sleep((long long)a->cell[0]->num);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+hisp* hisp_new(lenv* env);
+
+void hisp_del(hisp* h);
+
+/*
+** Actors
+**
+** An actor handles the messages sent to it one at a time, by calling its
+** function on each in an interpreter of its own. That interpreter starts from
+** a copy of the global environment the actor was made in, and nothing else
+** uses it, so an actor can keep state in it with def. Messages are moved into
+** a lock-free mailbox with many senders and the actor as the one receiver.
+** An actor with messages is run as a job of the worker pool until its mailbox
+** is empty, so actors run on as many cores as there are workers.
+*/
+
+typedef struct lmsg lmsg;
+
+struct lmsg {
+  lmsg* next;
+  lval* v;
+  /* Resolved with the actor's result when the message was asked */
+  lfuture* reply;
+  /* The interpreter counting it until it is handled, if any */
+  hisp* from;
+};
+
+typedef struct {
+  /* Senders swap themselves in at 'head', the receiver takes from 'tail' */
+  lmsg* head;
+  lmsg* tail;
+  lmsg stub;
+} lmailbox;
+
+struct lactor {
+  ljob job;
+  hisp* interp;
+  lval* handler;
+  lmailbox box;
+  /* Set while the actor is queued or running on the pool */
+  int scheduled;
+  int refs;
+};
+
+/* Actors queued or running in any interpreter, guarded by the pool lock */
+static int lactors_busy = 0;
+
+/* Count 'n' more messages sent from 'h' that are not handled yet */
+static void lactor_count(hisp* h, int n) {
+  if (h == NULL) { return; }
+  pthread_mutex_lock(&lpool.lock);
+  h->actors += n;
+  if (h->actors == 0) { pthread_cond_broadcast(&lpool.wake); }
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+static void lmailbox_init(lmailbox* q) {
+  q->stub.next = NULL;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+}
+
+static void lmailbox_push(lmailbox* q, lmsg* m) {
+  __atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+  lmsg* prev = __atomic_exchange_n(&q->head, m, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+/* The oldest message, or NULL if there is none or a sender is halfway through pushing */
+static lmsg* lmailbox_pop(lmailbox* q) {
+  lmsg* tail = q->tail;
+  lmsg* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &q->stub) {
+    if (next == NULL) { return NULL; }
+    q->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) { return NULL; }
+
+  // 'tail' is the last message, so put the stub behind it to take it
+  lmailbox_push(q, &q->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+/* Only the stub is left, with no sender pushing after it */
+static int lmailbox_empty(lmailbox* q) {
+  return q->tail == &q->stub && __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+void lactor_retain(lactor* ac) {
+  __atomic_add_fetch(&ac->refs, 1, __ATOMIC_RELAXED);
+}
+
+void lactor_release(lactor* ac) {
+  if (__atomic_sub_fetch(&ac->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
+  // nothing refers to an idle actor, so nothing can send to it any more
+  lmsg* m;
+  while ((m = lmailbox_pop(&ac->box))) {
+    lval_del(m->v);
+    free(m);
+  }
+  hisp_del(ac->interp);
+  lval_del(ac->handler);
+  free(ac);
+}
+
+static void lactor_run(ljob* j, int lo, int hi) {
+  lactor* ac = (lactor*)j;
+  lmsg* m;
+  while ((m = lmailbox_pop(&ac->box))) {
+    lval* g = lval_copy(ac->handler);
+    lval* x = lval_call(ac->interp->env, g, lval_add(lval_sexpr(), m->v));
+    lval_del(g);
+
+    if (m->reply) {
+      lfuture_resolve(m->reply, x);
+    } else {
+      // nothing waits for a told message, so its errors are printed like a script's
+      if (x->type == LVAL_ERR) { lval_println(ac->interp->out, x); }
+      lval_del(x);
+    }
+    lactor_count(m->from, -1);
+    free(m);
+  }
+}
+
+static int lactor_claim(lactor* ac) {
+  int idle = 0;
+  return __atomic_compare_exchange_n(&ac->scheduled, &idle, 1, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Run again if messages came after the mailbox was emptied, or else go idle */
+static void lactor_finish(ljob* j) {
+  lactor* ac = (lactor*)j;
+  __atomic_store_n(&ac->scheduled, 0, __ATOMIC_SEQ_CST);
+  if (!lmailbox_empty(&ac->box) && lactor_claim(ac)) {
+    lpool_submit(&ac->job, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&lpool.lock);
+  if (--lactors_busy == 0) { pthread_cond_broadcast(&lpool.wake); }
+  pthread_mutex_unlock(&lpool.lock);
+  lactor_release(ac);
+}
+
+static void lactor_send(lactor* ac, lval* v, lfuture* reply, hisp* from) {
+  lmsg* m = malloc(sizeof(lmsg));
+  m->v = v;
+  m->reply = reply;
+  m->from = from->root;
+  lactor_count(m->from, 1);
+  lmailbox_push(&ac->box, m);
+
+  if (lactor_claim(ac)) {
+    // the run holds a reference until the actor goes idle
+    lactor_retain(ac);
+    pthread_mutex_lock(&lpool.lock);
+    lactors_busy++;
+    pthread_mutex_unlock(&lpool.lock);
+    lpool_submit(&ac->job, 1);
+  }
+}
+
+/* Wait for every actor to handle all of its messages */
+void lactor_wait_all(void) {
+  lpool_wait(&lactors_busy);
+}
+
+/* Wait for actors to handle the messages that 'h' and the actors it made sent */
+void lactor_wait(hisp* h) {
+  lpool_wait(&h->actors);
+}
+
+lval* lval_actor(lenv* env, lval* handler) {
+  lactor* ac = calloc(1, sizeof(lactor));
+  ac->job.run    = lactor_run;
+  ac->job.finish = lactor_finish;
+  ac->interp  = hisp_new(env);
+  ac->interp->root = NULL;
+  ac->handler = handler;
+  ac->refs    = 1;
+  lmailbox_init(&ac->box);
+
+  lval* v = malloc(sizeof(lval));
+  v->type  = LVAL_ACTOR;
+  v->actor = ac;
+  return v;
+}
+
+lval* builtin_actor(lenv* e, lval* a) {
+  LASSERT_NUM("actor", a, 1);
+  LASSERT_TYPE("actor", a, 0, LVAL_FUN);
+
+  hisp* h = lenv_hisp(e);
+  pthread_rwlock_rdlock(&h->env_lock);
+  lenv* env = lenv_copy(h->env);
+  pthread_rwlock_unlock(&h->env_lock);
+
+  lval* v = lval_actor(env, lval_pop(a, 0));
+  v->actor->interp->out  = h->out;
+  v->actor->interp->root = h->root;
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_tell(lenv* e, lval* a) {
+  LASSERT_NUM("tell", a, 2);
+  LASSERT_TYPE("tell", a, 0, LVAL_ACTOR);
+
+  lactor_send(a->cell[0]->actor, lval_pop(a, 1), NULL, lenv_hisp(e));
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Send a message and return a Future of what the actor's function returns for it */
+lval* builtin_ask(lenv* e, lval* a) {
+  LASSERT_NUM("ask", a, 2);
+  LASSERT_TYPE("ask", a, 0, LVAL_ACTOR);
+
+  lval* v = lval_future(lfuture_new(lenv_hisp(e)));
+  lactor_send(a->cell[0]->actor, lval_pop(a, 1), v->future, lenv_hisp(e));
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return builtin_op(e, a, "/");
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+  return builtin_op(e, a, "%");
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+  return builtin_op(e, a, "^");
+}
+
+lval* builtin_var(lenv* e, lval* a, char* fn) {
+  LASSERT_TYPE(fn, a, 0, LVAL_QEXPR);
+
+  lval* syms = a->cell[0];
+
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, syms->cell[i]->type == LVAL_SYM, 
+        "Function '%s' cannot define non-symbol. Got %s, Expected %s",
+        fn, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(a, syms->count == (a->count - 1),
+    "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.",
+    fn, syms->count, a->count - 1);
+
+  for (int i = 0; i < syms->count; i++) {
+    lprof_name(a->cell[i + 1], syms->cell[i]->sym);
+    if (strcmp(fn, "def") == 0) {
+      lenv_def(e, syms->cell[i], a->cell[i + 1]);
+    }
+    if (strcmp(fn, "=") == 0) {
+      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+  return builtin_var(e, a, "def");
 }
 
 lval* builtin_put(lenv* e, lval* a) {
@@ -808,6 +3253,12 @@ int lval_eq(lval* x, lval* y) {
         return lval_eq(x->formals, y->formals) &&
                lval_eq(x->body, y->body);
       }
+    case LVAL_FUT:
+      return x->future == y->future;
+    case LVAL_CHAN:
+      return x->chan == y->chan;
+    case LVAL_ACTOR:
+      return x->actor == y->actor;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       if (x->count != y->count) {
@@ -865,45 +3316,96 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
+/* Evaluate each form read from a source, printing any errors, and free them */
+void lenv_eval_forms(lenv* e, lval* expr) {
+  /* Evaluate in place, as popping each form off the front is quadratic */
+  for (int i = 0; i < expr->count; i++) {
+    lval* x = lval_eval(e, expr->cell[i]);
+    if (x->type == LVAL_ERR) {
+      lval_println(lenv_out(e), x);
+    }
+    lval_del(x);
+  }
+
+  expr->count = 0;
+  lval_del(expr);
+}
+
 lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Hisp, &r)) {
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR) {
-        lval_println(x);
-      }
-      lval_del(x);
-    }
-
+  lval* expr = lval_read_file(lenv_hisp(e), a->cell[0]->str);
+  if (expr->type == LVAL_ERR) {
+    lval* err = lval_err("Could not load Library %s", expr->err);
     lval_del(expr);
     lval_del(a);
-    return lval_sexpr();
+    return err;
+  }
 
-  } else {
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+  lenv_eval_forms(e, expr);
+  lval_del(a);
+  return lval_sexpr();
+}
 
-    lval* err = lval_err("Could not load Library %s", err_msg);
-    free(err_msg);
+/*
+ * Like load, but each top-level form is evaluated as soon as it has been read
+ * and freed before the next is read, so only one form is held at a time. Forms
+ * before a syntax error have already run when it is reported. The mpc grammar
+ * can only parse whole files, so with --mpc this is the same as load.
+ */
+lval* builtin_load_stream(lenv* e, lval* a) {
+  LASSERT_NUM("load-stream", a, 1);
+  LASSERT_TYPE("load-stream", a, 0, LVAL_STR);
+
+  if (hisp_mpc_reader) { return builtin_load(e, a); }
+
+  char* filename = a->cell[0]->str;
+  lsource s;
+  int opened = lsource_open(&s, filename);
+  if (opened <= 0) {
+    lval* err = opened < 0
+      ? lval_err("Could not load Library %s: error: %s", filename, strerror(errno))
+      : lval_err("Could not load Library %s: error: Unable to open file!", filename);
     lval_del(a);
-
     return err;
   }
+
+  lreader r;
+  lreader_init(&r, strcmp(filename, "-") == 0 ? "<stdin>" : filename, s.src, s.len);
+
+  lval* result = lval_sexpr();
+  for (;;) {
+    lreader_skip(&r);
+    if (lreader_peek(&r, 0) == EOF) { break; }
+
+    lval* x = lreader_expr(&r);
+    if (x->type == LVAL_ERR) {
+      lval_del(result);
+      result = lval_err("Could not load Library %s", x->err);
+      lval_del(x);
+      break;
+    }
+
+    x = lval_eval(e, x);
+    if (x->type == LVAL_ERR) {
+      lval_println(lenv_out(e), x);
+    }
+    lval_del(x);
+  }
+
+  lsource_close(&s);
+  lval_del(a);
+  return result;
 }
 
 lval* builtin_print(lenv* e, lval* a) {
+  FILE* f = lenv_out(e);
   for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]);
-    putchar(' ');
+    lval_print(f, a->cell[i]);
+    fputc(' ', f);
   }
-  putchar('\n');
+  fputc('\n', f);
   lval_del(a);
   return lval_sexpr();
 }
@@ -917,7 +3419,7 @@ lval* builtin_error(lenv* e, lval* a) {
   return err;
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+static lval* lval_apply(lenv* e, lval* f, lval* a) {
   if (f->builtin) {
     return f->builtin(e, a);
   }
@@ -992,116 +3494,782 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   }
 }
 
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  if (!hisp_profile) { return lval_apply(e, f, a); }
+  lprof_push(f);
+  lval* x = lval_apply(e, f, a);
+  lprof_pop();
+  return x;
+}
+
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
+  v->name = name;
   lenv_put(e, k, v);
   lval_del(k);
   lval_del(v);
 }
 
+/* std.hisp, turned into a C string by the Makefile */
+static const char hisp_std[] =
+#include "std.h"
+;
+
+/* Define the standard library in e, as loading std.hisp would */
+void lenv_add_std(lenv* e) {
+  lval* expr = lval_read_string(lenv_hisp(e), "std.hisp", hisp_std, sizeof(hisp_std) - 1);
+  if (expr->type == LVAL_ERR) {
+    lval_println(lenv_out(e), expr);
+    lval_del(expr);
+    return;
+  }
+  lenv_eval_forms(e, expr);
+}
+
+/* Every builtin by name, which is also how images refer to them */
+typedef struct {
+  char* name;
+  lbuiltin func;
+} lbuiltin_entry;
+
+lbuiltin_entry lbuiltins[] = {
+  {"+", builtin_add},
+  {"-", builtin_sub},
+  {"*", builtin_mul},
+  {"/", builtin_div},
+  {"%", builtin_mod},
+  {"^", builtin_pow},
+
+  {"list", builtin_list},
+  {"head", builtin_head},
+  {"tail", builtin_tail},
+  {"join", builtin_join},
+  {"eval", builtin_eval},
+  {"len", builtin_len},
+  {"cons", builtin_cons},
+  {"init", builtin_init},
+  {"sort", builtin_sort},
+  {"sort-by", builtin_sort_by},
+  {"pmap", builtin_pmap},
+  {"pfilter", builtin_pfilter},
+  {"preduce", builtin_preduce},
+  {"future", builtin_future},
+  {"await", builtin_await},
+  {"await-all", builtin_await_all},
+  {"spawn", builtin_spawn},
+  {"yield", builtin_yield},
+  {"chan", builtin_chan},
+  {"send", builtin_send},
+  {"recv", builtin_recv},
+  {"open", builtin_open},
+  {"listen", builtin_listen},
+  {"connect", builtin_connect},
+  {"accept", builtin_accept},
+  {"read", builtin_read},
+  {"write", builtin_write},
+  {"close", builtin_close},
+  {"sleep", builtin_sleep},
+  {"actor", builtin_actor},
+  {"tell", builtin_tell},
+  {"ask", builtin_ask},
+  {"def", builtin_def},
+  {"\\", builtin_lambda},
+  {"=", builtin_put},
+
+  {"if", builtin_if},
+  {"==", builtin_eq},
+  {"!=", builtin_ne},
+  {">", builtin_gt},
+  {"<", builtin_lt},
+  {">=", builtin_ge},
+  {"<=", builtin_le},
+
+  {"load", builtin_load},
+  {"load-stream", builtin_load_stream},
+  {"error", builtin_error},
+  {"print", builtin_print},
+  {NULL, NULL}
+};
+
+char* lbuiltin_name(lbuiltin func) {
+  for (int i = 0; lbuiltins[i].name; i++) {
+    if (lbuiltins[i].func == func) { return lbuiltins[i].name; }
+  }
+  return "";
+}
+
+lbuiltin lbuiltin_find(char* name) {
+  for (int i = 0; lbuiltins[i].name; i++) {
+    if (strcmp(lbuiltins[i].name, name) == 0) { return lbuiltins[i].func; }
+  }
+  return NULL;
+}
+
 void lenv_add_builtins(lenv* e) {
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-  lenv_add_builtin(e, "%", builtin_mod);
-  lenv_add_builtin(e, "^", builtin_pow);
-
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "len",  builtin_len);
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "init", builtin_init);
-  lenv_add_builtin(e, "def",  builtin_def);
-  lenv_add_builtin(e, "\\",   builtin_lambda);
-  lenv_add_builtin(e, "=",    builtin_put);
-
-  lenv_add_builtin(e, "if", builtin_if);
-  lenv_add_builtin(e, "==", builtin_eq);
-  lenv_add_builtin(e, "!=", builtin_ne);
-  lenv_add_builtin(e, ">",  builtin_gt);
-  lenv_add_builtin(e, "<",  builtin_lt);
-  lenv_add_builtin(e, ">=", builtin_ge);
-  lenv_add_builtin(e, "<=", builtin_le);
-
-  lenv_add_builtin(e, "load",  builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  for (int i = 0; lbuiltins[i].name; i++) {
+    lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+  }
 }
 
-int main(int argc, char **argv) {
-  /* Create some parsers */
-  Number   = mpc_new("number");
-  Symbol   = mpc_new("symbol");
-  String   = mpc_new("string");
-  Comment  = mpc_new("comment");
-  Sexpr    = mpc_new("sexpr");
-  Qexpr    = mpc_new("qexpr");
-  Expr     = mpc_new("expr");
-  Hisp     = mpc_new("hisp");
+/*
+** Images are snapshots of the global environment, so that a process can start
+** from a loaded environment without reading and evaluating its sources again.
+** Values are written depth first with lengths in place of pointers, so an
+** image can be mapped anywhere. Builtins are written by name, and numbers as
+** the raw long double, which ties an image to builds with the same layout.
+*/
+#define LIMAGE_MAGIC "HISPIMG"
+#define LIMAGE_VERSION 1
+
+void limage_write_u32(FILE* f, unsigned int x) {
+  unsigned char b[4] = { x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, (x >> 24) & 0xFF };
+  fwrite(b, 1, 4, f);
+}
 
-  /* Define them with the following Language */
-  mpca_lang(MPC_LANG_DEFAULT,
-      "                                                 \
-        number   : /-?[0-9]+\\.?[0-9]*/ ;               \
-        symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=%^<>!&]+/ ; \
-        string   : /\"(\\\\.|[^\"])*\"/ ;               \
-        comment  : /;[^\\r\\n]*/ ;                      \
-        sexpr    : '(' <expr>* ')' ;                    \
-        qexpr    : '{' <expr>* '}' ;                    \
-        expr     : <number>  | <symbol> | <string>      \
-                 | <comment> | <sexpr>  | <qexpr>  ;    \
-        hisp     : /^/ <expr>* /$/ ;                    \
-      ",
-      Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Hisp);
+void limage_write_str(FILE* f, char* s) {
+  size_t len = strlen(s);
+  limage_write_u32(f, len);
+  fwrite(s, 1, len, f);
+}
+
+void limage_write_lenv(FILE* f, lenv* e);
+
+void limage_write_lval(FILE* f, lval* v) {
+  /* The image holds the value a future came to */
+  if (v->type == LVAL_FUT) {
+    lpool_wait(&v->future->running);
+    v = v->future->result;
+  }
+
+  fputc(v->type, f);
+  switch (v->type) {
+    case LVAL_NUM: fwrite(&v->num, sizeof(long double), 1, f); break;
+    case LVAL_ERR: limage_write_str(f, v->err); break;
+    case LVAL_SYM: limage_write_str(f, v->sym); break;
+    case LVAL_STR: limage_write_str(f, v->str); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      limage_write_u32(f, v->count);
+      for (int i = 0; i < v->count; i++) {
+        limage_write_lval(f, v->cell[i]);
+      }
+      break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        fputc(1, f);
+        limage_write_str(f, lbuiltin_name(v->builtin));
+      } else {
+        /* The parent of a lambda's environment is set when it is called */
+        fputc(0, f);
+        limage_write_lenv(f, v->env);
+        limage_write_lval(f, v->formals);
+        limage_write_lval(f, v->body);
+      }
+      break;
+    case LVAL_CHAN:
+      /* Written with the values it holds. Copies of it are read back as separate channels */
+      limage_write_u32(f, v->chan->cap);
+      limage_write_u32(f, v->chan->count);
+      for (int i = 0; i < v->chan->count; i++) {
+        limage_write_lval(f, v->chan->items[(v->chan->first + i) % v->chan->size]);
+      }
+      break;
+    case LVAL_ACTOR:
+      /* Written as its function and environment, with an empty mailbox */
+      limage_write_lval(f, v->actor->handler);
+      limage_write_lenv(f, v->actor->interp->env);
+      break;
+  }
+}
+
+void limage_write_lenv(FILE* f, lenv* e) {
+  limage_write_u32(f, e->count);
+  for (int i = 0; i < e->count; i++) {
+    limage_write_str(f, e->syms[i]);
+    limage_write_lval(f, e->vals[i]);
+  }
+}
+
+/* Write the global environment e to an image, returning zero on failure */
+int lenv_dump_image(lenv* e, char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) { return 0; }
+
+  fwrite(LIMAGE_MAGIC, 1, 8, f);
+  limage_write_u32(f, LIMAGE_VERSION);
+  limage_write_u32(f, sizeof(long double));
+  /* Futures def into it from other threads */
+  if (e->owner) { pthread_rwlock_rdlock(&e->owner->env_lock); }
+  limage_write_lenv(f, e);
+  if (e->owner) { pthread_rwlock_unlock(&e->owner->env_lock); }
+
+  int ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
 
+/*
+ * Values nest no deeper than this in an image read back, so a corrupt one is
+ * rejected rather than overflowing the stack of the recursive reader
+ */
+#define LIMAGE_MAX_DEPTH 10000
+
+/* Position in a mapped image, cleared ok once anything is out of bounds */
+typedef struct {
+  const char* at;
+  const char* end;
+  int ok;
+  /* How many values being read enclose the next one */
+  int depth;
+} limage;
+
+int limage_has(limage* r, size_t n) {
+  if (r->ok && (size_t)(r->end - r->at) >= n) { return 1; }
+  r->ok = 0;
+  return 0;
+}
+
+int limage_read_byte(limage* r) {
+  if (!limage_has(r, 1)) { return -1; }
+  return (unsigned char)*r->at++;
+}
+
+unsigned int limage_read_u32(limage* r) {
+  if (!limage_has(r, 4)) { return 0; }
+  const unsigned char* b = (const unsigned char*)r->at;
+  r->at += 4;
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+char* limage_read_str(limage* r) {
+  unsigned int len = limage_read_u32(r);
+  if (!limage_has(r, len)) { len = 0; }
+  char* s = malloc(len + 1);
+  memcpy(s, r->at, len);
+  s[len] = '\0';
+  r->at += len;
+  return s;
+}
+
+lval* limage_read_lval(limage* r);
+lenv* limage_read_lenv(limage* r);
+
+static lval* limage_read_value(limage* r) {
+  lval* v;
+  char* s;
+  unsigned int count, cap;
+  int type = limage_read_byte(r);
+
+  switch (type) {
+    case LVAL_NUM:
+      v = lval_num(0);
+      if (limage_has(r, sizeof(long double))) {
+        memcpy(&v->num, r->at, sizeof(long double));
+        r->at += sizeof(long double);
+      }
+      return v;
+    case LVAL_ERR:
+      v = malloc(sizeof(lval));
+      v->type = LVAL_ERR;
+      v->err = limage_read_str(r);
+      return v;
+    case LVAL_SYM:
+      v = malloc(sizeof(lval));
+      v->type = LVAL_SYM;
+      v->sym = limage_read_str(r);
+      return v;
+    case LVAL_STR:
+      v = malloc(sizeof(lval));
+      v->type = LVAL_STR;
+      v->str = limage_read_str(r);
+      return v;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+      count = limage_read_u32(r);
+      /* Every value takes at least a byte, which bounds a corrupt count */
+      if (!limage_has(r, count)) { return v; }
+      v->count = count;
+      v->cell = malloc(sizeof(lval*) * count);
+      for (unsigned int i = 0; i < count; i++) {
+        v->cell[i] = limage_read_lval(r);
+      }
+      return v;
+    case LVAL_FUN:
+      type = limage_read_byte(r);
+      if (type != 0 && type != 1) {
+        r->ok = 0;
+        return lval_sexpr();
+      }
+      if (type == 1) {
+        s = limage_read_str(r);
+        lbuiltin func = lbuiltin_find(s);
+        if (func == NULL) { free(s); r->ok = 0; return lval_sexpr(); }
+        v = lval_fun(func);
+        lprof_name(v, s);
+        free(s);
+        return v;
+      }
+      v = malloc(sizeof(lval));
+      v->type    = LVAL_FUN;
+      v->builtin = NULL;
+      v->name    = NULL;
+      v->env     = limage_read_lenv(r);
+      v->formals = limage_read_lval(r);
+      v->body    = limage_read_lval(r);
+      /* Calls take the formals and body as they are, so check them here */
+      int valid = v->formals->type == LVAL_QEXPR && v->body->type == LVAL_QEXPR;
+      for (int i = 0; valid && i < v->formals->count; i++) {
+        valid = v->formals->cell[i]->type == LVAL_SYM;
+      }
+      if (!valid) {
+        lval_del(v);
+        r->ok = 0;
+        return lval_sexpr();
+      }
+      return v;
+    case LVAL_CHAN:
+      cap = limage_read_u32(r);
+      count = limage_read_u32(r);
+      if (cap < 1 || cap > INT_MAX || count > cap || !limage_has(r, count)) {
+        r->ok = 0;
+        return lval_sexpr();
+      }
+      v = lval_chan(lchan_new(cap));
+      for (unsigned int i = 0; i < count && r->ok; i++) {
+        if (!lchan_reserve(v->chan)) {
+          r->ok = 0;
+          break;
+        }
+        lchan_put(v->chan, limage_read_lval(r));
+      }
+      return v;
+    case LVAL_ACTOR:
+      v = limage_read_lval(r);
+      if (v->type != LVAL_FUN) {
+        r->ok = 0;
+        return v;
+      }
+      return lval_actor(limage_read_lenv(r), v);
+    default:
+      r->ok = 0;
+      return lval_sexpr();
+  }
+}
+
+lval* limage_read_lval(limage* r) {
+  if (r->depth >= LIMAGE_MAX_DEPTH) {
+    r->ok = 0;
+    return lval_sexpr();
+  }
+  r->depth++;
+  lval* v = limage_read_value(r);
+  r->depth--;
+  return v;
+}
+
+lenv* limage_read_lenv(limage* r) {
   lenv* e = lenv_new();
-  lenv_add_builtins(e);
+  unsigned int count = limage_read_u32(r);
+  if (!limage_has(r, count)) { return e; }
+
+  e->count = count;
+  e->syms = malloc(sizeof(char*) * count);
+  e->vals = malloc(sizeof(lval*) * count);
+  for (unsigned int i = 0; i < count; i++) {
+    e->syms[i] = limage_read_str(r);
+    e->vals[i] = limage_read_lval(r);
+    lprof_name(e->vals[i], e->syms[i]);
+  }
+  return e;
+}
 
-  if (argc == 1) {
-    puts("Hercules Lisp Version 0.0.0.1.0");
-    puts("Press Ctrl+c to Exit\n");
+/* Read a global environment back from an image, or NULL if it is not one */
+lenv* lenv_load_image(char* filename) {
+  lsource s;
+  if (lsource_open(&s, filename) <= 0) { return NULL; }
+
+  limage r = { s.src, s.src + s.len, 1, 0 };
+  lenv* e = NULL;
+
+  if (limage_has(&r, 8) && memcmp(r.at, LIMAGE_MAGIC, 8) == 0) {
+    r.at += 8;
+    if (limage_read_u32(&r) == LIMAGE_VERSION
+    &&  limage_read_u32(&r) == sizeof(long double)) {
+      e = limage_read_lenv(&r);
+      if (!r.ok || r.at != r.end) {
+        lenv_del(e);
+        e = NULL;
+      }
+    }
+  }
+  lsource_close(&s);
 
-    while(1) {
-      char *input = readline("hisp> ");
-      add_history(input);
+  /* Builtins added since the image was written */
+  for (int i = 0; e && lbuiltins[i].name; i++) {
+    int bound = 0;
+    for (int j = 0; j < e->count && !bound; j++) {
+      bound = strcmp(e->syms[j], lbuiltins[i].name) == 0;
+    }
+    if (!bound) { lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func); }
+  }
 
-      /* Attempt to parse the user input */
-      mpc_result_t r;
-      if(mpc_parse("<stdin>", input, Hisp, &r)) {
-        lval* x = lval_eval(e, lval_read(r.output));
-        lval_println(x);
+  return e;
+}
+
+/*
+** Files read by load can be cached as the forms they were read into, written
+** in the image format to HISP_CACHE_DIR when it is set. Entries are named by a
+** hash of the source and checked against its length and the interpreter
+** version, so an edited file or a new hisp simply misses and is read again.
+*/
+#define LCACHE_MAGIC "HISPFRM"
+
+unsigned long long lcache_hash(const char* src, size_t len) {
+  /* FNV-1a, seeded differently for each reader */
+  unsigned long long h = 14695981039346656037ULL ^ hisp_mpc_reader;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)src[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Take the cache directory from HISP_CACHE_DIR, making it if it is missing */
+void lcache_init(void) {
+  char* dir = getenv("HISP_CACHE_DIR");
+  if (dir == NULL || dir[0] == '\0') { return; }
+  mkdir(dir, 0777);
+  hisp_cache_dir = dir;
+}
+
+char* lcache_path(const char* src, size_t len) {
+  if (hisp_cache_dir == NULL) { return NULL; }
+
+  char* path = malloc(strlen(hisp_cache_dir) + 32);
+  sprintf(path, "%s/%016llx.hfc", hisp_cache_dir, lcache_hash(src, len));
+  return path;
+}
+
+/* The forms cached for a source, or NULL if there are none */
+lval* lcache_read(const char* src, size_t len) {
+  char* path = lcache_path(src, len);
+  if (path == NULL) { return NULL; }
+
+  lsource s;
+  int found = lsource_open(&s, path) > 0;
+  free(path);
+  if (!found) { return NULL; }
+
+  limage r = { s.src, s.src + s.len, 1, 0 };
+  lval* x = NULL;
+
+  if (limage_has(&r, 8) && memcmp(r.at, LCACHE_MAGIC, 8) == 0) {
+    r.at += 8;
+    char* version = limage_read_str(&r);
+    if (strcmp(version, HISP_VERSION) == 0
+    &&  limage_read_u32(&r) == sizeof(long double)
+    &&  limage_read_u32(&r) == (unsigned int)len
+    &&  limage_read_u32(&r) == (unsigned int)((unsigned long long)len >> 32)) {
+      x = limage_read_lval(&r);
+      if (!r.ok || r.at != r.end || x->type != LVAL_SEXPR) {
         lval_del(x);
+        x = NULL;
+      }
+    }
+    free(version);
+  }
 
-        mpc_ast_delete(r.output);
-      } else {
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
+  lsource_close(&s);
+  return x;
+}
+
+/* Cache the forms read from a source, ignoring any failure to */
+void lcache_write(const char* src, size_t len, lval* x) {
+  if (x->type != LVAL_SEXPR) { return; }
+
+  char* path = lcache_path(src, len);
+  if (path == NULL) { return; }
+
+  /*
+   * Written aside and renamed into place, so readers never see half an entry.
+   * The name is unique to this write, as --parallel scripts may write at once
+   */
+  char* tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  FILE* f = NULL;
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+    f = fdopen(fd, "wb");
+    if (f == NULL) {
+      close(fd);
+      remove(tmp);
+    }
+  }
+
+  if (f != NULL) {
+    fwrite(LCACHE_MAGIC, 1, 8, f);
+    limage_write_str(f, HISP_VERSION);
+    limage_write_u32(f, sizeof(long double));
+    limage_write_u32(f, (unsigned int)len);
+    limage_write_u32(f, (unsigned int)((unsigned long long)len >> 32));
+    limage_write_lval(f, x);
+    int ok = !ferror(f);
+    if (fclose(f) == 0 && ok) {
+      rename(tmp, path);
+    } else {
+      remove(tmp);
+    }
+  }
+
+  free(tmp);
+  free(path);
+}
+
+/* Make an interpreter around the global environment 'env', which it then owns */
+hisp* hisp_new(lenv* env) {
+  hisp* h = calloc(1, sizeof(hisp));
+  h->env = env;
+  env->owner = h;
+  h->out = stdout;
+  h->root = h;
+  pthread_rwlock_init(&h->env_lock, NULL);
+  return h;
+}
+
+void hisp_del(hisp* h) {
+  /* Futures still running use the environment */
+  lpool_wait(&h->futures);
+  lenv_del(h->env);
+  pthread_rwlock_destroy(&h->env_lock);
+  /* Undefine and delete our parsers, if they were ever built */
+  if (h->Hisp) {
+    mpc_cleanup(8, h->Number, h->Symbol, h->String, h->Comment,
+                   h->Sexpr, h->Qexpr, h->Expr, h->Hisp);
+    mpc_ctx_delete(h->ctx);
+  }
+  free(h->tag_kinds);
+  free(h);
+}
+
+/* Load a script given to hisp, printing the error it came to, then run its green threads */
+void hisp_run_script(hisp* h, char* path) {
+  lval* args = lval_add(lval_sexpr(), lval_str(path));
+  lval* x    = hisp_stream_scripts
+    ? builtin_load_stream(h->env, args)
+    : builtin_load(h->env, args);
+
+  if (x->type == LVAL_ERR) {
+    lval_println(h->out, x);
+  }
+  lval_del(x);
+  lgreen_run();
+}
+
+/*
+** Parallel scripts
+**
+** --parallel loads each script in an interpreter of its own, started from a
+** copy of the global environment the prelude left. Scripts are taken in turn
+** by threads of their own rather than the worker pool's. The pool is still
+** shared: a script waiting in await, pmap or for its actors helps run queued
+** tasks, which may be another script's futures or actor messages, each in its
+** own interpreter. A script waits only for the messages it sent. Each prints
+** into a buffer, written out in the order the scripts were given once all
+** those before it have been.
+*/
+
+typedef struct {
+  hisp* base;
+  char** paths;
+  int count;
+  /* The next script to start, and the next whose output is due */
+  int next;
+  int written;
+  char** outs;
+  size_t* lens;
+  int* finished;
+  pthread_mutex_t lock;
+} lbatch;
+
+static void* lbatch_worker(void* arg) {
+  lbatch* b = arg;
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    int i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->count) { return NULL; }
+
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&buf, &len);
+
+    hisp* h = hisp_new(lenv_copy(b->base->env));
+    if (out) { h->out = out; }
+    hisp_run_script(h, b->paths[i]);
+    /* Actors the script made print into its buffer too */
+    lactor_wait(h);
+    hisp_del(h);
+    if (out) { fclose(out); }
+
+    pthread_mutex_lock(&b->lock);
+    b->outs[i] = buf;
+    b->lens[i] = len;
+    b->finished[i] = 1;
+    while (b->written < b->count && b->finished[b->written]) {
+      if (b->outs[b->written]) {
+        fwrite(b->outs[b->written], 1, b->lens[b->written], stdout);
+        free(b->outs[b->written]);
       }
+      b->written++;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&b->lock);
+  }
+}
 
-      free(input);
+/* Run the 'count' scripts at 'paths' from the environment of 'base', 'threads' at a time */
+void lbatch_run(hisp* base, char** paths, int count, int threads) {
+  lbatch b;
+  b.base  = base;
+  b.paths = paths;
+  b.count = count;
+  b.next  = 0;
+  b.written  = 0;
+  b.outs     = calloc(count, sizeof(char*));
+  b.lens     = calloc(count, sizeof(size_t));
+  b.finished = calloc(count, sizeof(int));
+  pthread_mutex_init(&b.lock, NULL);
+
+  if (threads > count) { threads = count; }
+  pthread_t* ts = malloc(sizeof(pthread_t) * threads);
+  int started = 0;
+  while (started < threads
+      && pthread_create(&ts[started], NULL, lbatch_worker, &b) == 0) {
+    started++;
+  }
+  /* Should no thread start, the scripts are run here */
+  if (started == 0) { lbatch_worker(&b); }
+  for (int i = 0; i < started; i++) {
+    pthread_join(ts[i], NULL);
+  }
+
+  free(ts);
+  free(b.outs);
+  free(b.lens);
+  free(b.finished);
+  pthread_mutex_destroy(&b.lock);
+}
+
+int main(int argc, char **argv) {
+  /* Options come before any script */
+  char* image_in = NULL;
+  char* image_out = NULL;
+  char* prelude = NULL;
+  int parallel = 0;
+  int first = 1;
+  for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+    if (strcmp(argv[first], "--mpc") == 0) {
+      hisp_mpc_reader = 1;
+    } else if (strcmp(argv[first], "--stream") == 0) {
+      hisp_stream_scripts = 1;
+    } else if (strcmp(argv[first], "--no-std") == 0) {
+      hisp_builtin_std = 0;
+    } else if (strcmp(argv[first], "--workers") == 0 && first + 1 < argc) {
+      hisp_workers = atoi(argv[++first]);
+    } else if (strcmp(argv[first], "--parallel") == 0 && first + 1 < argc) {
+      parallel = atoi(argv[++first]);
+      if (parallel < 1) { parallel = 1; }
+    } else if (strcmp(argv[first], "--profile") == 0 && first + 1 < argc) {
+      hisp_profile = argv[++first];
+    } else if (strcmp(argv[first], "--prelude") == 0 && first + 1 < argc) {
+      prelude = argv[++first];
+    } else if (strcmp(argv[first], "--image") == 0 && first + 1 < argc) {
+      image_in = argv[++first];
+    } else if (strcmp(argv[first], "--dump-image") == 0 && first + 1 < argc) {
+      image_out = argv[++first];
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+      return 1;
+    }
+  }
+
+  if (hisp_profile && !lprof_start()) {
+    fprintf(stderr, "Could not start profiling\n");
+    return 1;
+  }
+  lcache_init();
+
+  hisp* h;
+  if (image_in) {
+    lenv* e = lenv_load_image(image_in);
+    if (e == NULL) {
+      fprintf(stderr, "Could not load image '%s'\n", image_in);
+      return 1;
+    }
+    h = hisp_new(e);
+  } else {
+    h = hisp_new(lenv_new());
+    lenv_add_builtins(h->env);
+    if (hisp_builtin_std) {
+      lenv_add_std(h->env);
     }
   }
 
-  if (argc >= 2) {
-    for (int i = 1; i < argc; i++) {
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-      lval* x    = builtin_load(e, args);
+  if (prelude) {
+    hisp_run_script(h, prelude);
+  }
+
+  if (argc == first && !image_out) {
+    puts("Hercules Lisp Version " HISP_VERSION);
+    puts("Press Ctrl+c to Exit\n");
+
+    while(1) {
+      char *input = readline("hisp> ");
+      if (input == NULL) {
+        putchar('\n');
+        break;
+      }
+      add_history(input);
 
+      /* Attempt to read the user input */
+      lval* x = lval_read_string(h, "<stdin>", input, strlen(input));
       if (x->type == LVAL_ERR) {
-        lval_println(x);
+        puts(x->err);
+      } else {
+        x = lval_eval(h->env, x);
+        lval_println(h->out, x);
       }
       lval_del(x);
+      lgreen_run();
+
+      free(input);
+    }
+  }
+
+  if (argc > first && parallel) {
+    lbatch_run(h, argv + first, argc - first, parallel);
+  } else {
+    for (int i = first; i < argc; i++) {
+      hisp_run_script(h, argv[i]);
     }
   }
 
-  lenv_del(e);
-  /* Undefine and delete our parsers */
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Hisp);
+  /* Actors may still be handling messages the scripts sent, and futures running */
+  lactor_wait_all();
+  lpool_wait(&h->futures);
 
-  return 0;
+  int status = 0;
+  if (image_out && !lenv_dump_image(h->env, image_out)) {
+    fprintf(stderr, "Could not write image '%s'\n", image_out);
+    status = 1;
+  }
+  if (hisp_profile && !lprof_stop(hisp_profile)) {
+    fprintf(stderr, "Could not write profile '%s'\n", hisp_profile);
+    status = 1;
+  }
+
+  hisp_del(h);
+
+  return status;
 }
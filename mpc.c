@@ -1,5 +1,47 @@
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#define MPC_USE_MMAP
+#endif
+
 #include "mpc.h"
 
+#ifdef MPC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+** Threads
+**
+** Separate threads may parse with separate parsers
+** at the same time. State kept between parses is
+** either per thread or, for the interned tags,
+** shared behind a lock.
+*/
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define MPC_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
 /*
 ** State Type
 */
@@ -26,19 +68,6 @@ static mpc_state_t mpc_state_new(void) {
 ** Error Type
 */
 
-static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected) {
-  mpc_err_t *x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = s;
-  x->expected_num = 1;
-  x->expected = malloc(sizeof(char*));
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  return x;
-}
-
 static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
   mpc_err_t *x = malloc(sizeof(mpc_err_t));
   x->filename = malloc(strlen(filename) + 1);
@@ -83,19 +112,6 @@ static void mpc_err_add_expected(mpc_err_t *x, char *expected) {
   
 }
 
-static void mpc_err_clear_expected(mpc_err_t *x, char *expected) {
-  
-  int i;
-  for (i = 0; i < x->expected_num; i++) {
-    free(x->expected[i]);
-  }
-  x->expected_num = 1;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[0] = malloc(strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  
-}
-
 void mpc_err_print(mpc_err_t *x) {
   mpc_err_print_to(x, stdout);
 }
@@ -116,13 +132,18 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+/*
+** Characters are quoted into a buffer of the
+** caller's rather than a static one, so errors
+** can be printed from several threads at once.
+*/
 
-static char *mpc_err_char_unescape(char c) {
+static char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     
@@ -136,8 +157,8 @@ static char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -145,6 +166,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char quoted[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -174,50 +196,13 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->state.next));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->state.next, quoted));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
-  
-  int i, j;
-  mpc_err_t *e = malloc(sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = malloc(strlen(x[0]->filename)+1);
-  strcpy(e->filename, x[0]->filename);
-  
-  for (i = 0; i < n; i++) {
-    if (x[i]->state.pos > e->state.pos) { e->state = x[i]->state; }
-  }
-  
-  for (i = 0; i < n; i++) {
-    
-    if (x[i]->state.pos < e->state.pos) { continue; }
-    
-    if (x[i]->failure) {
-      e->failure = malloc(strlen(x[i]->failure)+1);
-      strcpy(e->failure, x[i]->failure);
-      break;
-    }
-    
-    for (j = 0; j < x[i]->expected_num; j++) {
-      if (!mpc_err_contains_expected(e, x[i]->expected[j])) { mpc_err_add_expected(e, x[i]->expected[j]); }
-    }
-  }
-  
-  for (i = 0; i < n; i++) {
-    mpc_err_delete(x[i]);
-  }
-  
-  return e;
-}
-
-static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
+static char *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
   int i;
   char *expect = malloc(strlen(prefix) + 1);
@@ -244,25 +229,8 @@ static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
   }
   
-  mpc_err_clear_expected(x, expect);
-  free(expect);
-  
-  return x;
-
-}
+  return expect;
 
-static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
-  return mpc_err_repeat(x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(x, prefix);
-  free(prefix);
-  return y;
 }
 
 /*
@@ -273,8 +241,8 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
+** String is easy. The contents are scanned
+** through in place, never copied.
 ** The cursor can jump around at will making 
 ** backtracking easy.
 **
@@ -306,44 +274,100 @@ enum {
   MPC_INPUT_PIPE   = 2
 };
 
+/*
+** A memoized result of parser `p` at input
+** position `pos`, along with the state the input
+** was left in. The mode records whether spans
+** and backtracking were active, as both change
+** what a parser outputs.
+*/
+
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  int mode;
+  int success;
+  mpc_state_t end;
+  mpc_result_t r;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  size_t length;
   char *buffer;
+  int buffer_pos;
+  int buffer_num;
+  int buffer_slots;
   FILE *file;
   
+  int spans;
+  
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   
+  int memo_num;
+  int memo_slots;
+  mpc_memo_t *memo;
+  
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** String inputs reference the caller's memory
+** rather than copying it, so the string must
+** outlive the parse. The length is computed once
+** up front so that checking for the end of input
+** is constant time.
+*/
+
+/* Sets up everything but the filename and the memory held for marks */
+static void mpc_input_set_nstring(mpc_input_t *i, const char *string, size_t length) {
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
-  
-  i->filename = malloc(strlen(filename) + 1);
-  strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
-  
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
+  i->length = length;
   i->buffer = NULL;
   i->file = NULL;
   
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->spans = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
+  
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+}
+
+static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+
+  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  
+  i->filename = malloc(strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  
+  i->marks_slots = 0;
   i->marks = NULL;
+  mpc_input_set_nstring(i, string, length);
   
   return i;
 }
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
 static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -355,13 +379,24 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->spans = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
   return i;
   
 }
@@ -376,23 +411,36 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
+  i->buffer_pos = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->spans = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   
+  i->memo_num = 0;
+  i->memo_slots = 0;
+  i->memo = NULL;
+  
   return i;
 }
 
+static void mpc_input_memo_clear(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  mpc_input_memo_clear(i);
   free(i->marks);
   free(i);
 }
@@ -400,16 +448,29 @@ static void mpc_input_delete(mpc_input_t *i) {
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
+/*
+** Marks and the pipe backtrack buffer grow
+** geometrically and track their own lengths, so
+** that marking and buffering are amortised
+** constant time per character. The buffer keeps
+** its memory between marks and is only released
+** along with the input.
+*/
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+  }
   i->marks[i->marks_num-1] = i->state;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1 && i->spans == 0) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_num = 0;
   }
   
 }
@@ -419,11 +480,9 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0 && i->spans == 0) {
+    i->buffer_num = 0;
   }
   
 }
@@ -441,18 +500,31 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
+static int mpc_input_buffering(mpc_input_t *i) {
+  return i->type == MPC_INPUT_PIPE && (i->marks_num > 0 || i->spans > 0);
+}
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < (i->buffer_num + i->buffer_pos);
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->state.pos - i->buffer_pos];
+}
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  if (i->buffer_num == i->buffer_slots) {
+    i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : 4096;
+    i->buffer = realloc(i->buffer, i->buffer_slots);
+  }
+  i->buffer[i->buffer_num++] = c;
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && (size_t)i->state.pos >= i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && feof(i->file) &&
+      !(mpc_input_buffering(i) && mpc_input_buffer_in_range(i))) { return 1; }
   return 0;
 }
 
@@ -461,13 +533,13 @@ static char mpc_input_getc(mpc_input_t *i) {
   char c;
   switch (i->type) {
     
-    case MPC_INPUT_STRING: c = i->string[i->state.pos]; break;
+    case MPC_INPUT_STRING: c = (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0'; break;
     case MPC_INPUT_FILE: c = fgetc(i->file); break;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); break; }
+      if (!mpc_input_buffering(i)) { c = getc(i->file); break; }
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -487,9 +559,9 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
+      if (!mpc_input_buffering(i)) { ungetc(c, i->file); break; }
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -503,13 +575,8 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  if (mpc_input_buffering(i) && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_push(i, c);
   }
 
   i->state.pos++;
@@ -520,7 +587,9 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->spans) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = malloc(2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -592,11 +661,162 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (i->spans) {
+    *o = NULL;
+  } else {
+    *o = malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
+/*
+** Spans
+**
+** Inside a span the primitive parsers consume
+** input without building any output for it.
+** Once the span ends the text it covered is
+** copied out of the input a single time, rather
+** than being built up one character at a time.
+*/
+
+static void mpc_input_span_begin(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffering(i)) {
+    i->buffer_pos = i->state.pos;
+    i->buffer_num = 0;
+  }
+  i->spans++;
+}
+
+static char *mpc_input_span_end(mpc_input_t *i, int start) {
+  
+  int n = i->state.pos - start;
+  char *o = malloc(n + 1);
+  long cur;
+  
+  switch (i->type) {
+    case MPC_INPUT_STRING: memcpy(o, i->string + start, n); break;
+    case MPC_INPUT_FILE:
+      cur = ftell(i->file);
+      fseek(i->file, start, SEEK_SET);
+      n = fread(o, 1, n, i->file);
+      fseek(i->file, cur, SEEK_SET);
+      break;
+    case MPC_INPUT_PIPE: memcpy(o, i->buffer + (start - i->buffer_pos), n); break;
+  }
+  o[n] = '\0';
+  
+  i->spans--;
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffering(i)) {
+    i->buffer_num = 0;
+  }
+  
+  return o;
+}
+
+static void mpc_input_span_fail(mpc_input_t *i) {
+  i->spans--;
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffering(i)) {
+    i->buffer_num = 0;
+  }
+}
+
+/*
+** Memoization
+**
+** Memoized results are kept in an open addressed
+** hash table on the input keyed by parser and
+** position. Only string inputs are memoized, as
+** a hit must be able to jump straight to the end
+** state of the stored result.
+**
+** Each parse stores at most `MPC_MEMO_MAX`
+** results. Once full, further results are simply
+** not stored and parsing continues unmemoized.
+*/
+
+#define MPC_MEMO_MAX 65536
+
+static MPC_THREAD_LOCAL unsigned long mpc_memo_hits = 0;
+static MPC_THREAD_LOCAL unsigned long mpc_memo_misses = 0;
+
+void mpca_memo_stats(unsigned long *hits, unsigned long *misses) {
+  *hits = mpc_memo_hits;
+  *misses = mpc_memo_misses;
+}
+
+static int mpc_input_memo_mode(mpc_input_t *i) {
+  return (i->spans > 0) | ((i->backtrack > 0) << 1);
+}
+
+static int mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, int pos) {
+  unsigned long h = ((unsigned long)p >> 4) * 2654435761UL + (unsigned long)pos * 40503UL;
+  return (int)(h & (unsigned long)(i->memo_slots - 1));
+}
+
+static mpc_memo_t *mpc_input_memo_find(mpc_input_t *i, mpc_parser_t *p) {
+  
+  int k, mode = mpc_input_memo_mode(i);
+  
+  if (i->memo_slots == 0) { return NULL; }
+  
+  k = mpc_input_memo_slot(i, p, i->state.pos);
+  while (i->memo[k].p) {
+    if (i->memo[k].p == p && i->memo[k].pos == i->state.pos && i->memo[k].mode == mode) {
+      return &i->memo[k];
+    }
+    k = (k + 1) & (i->memo_slots - 1);
+  }
+  
+  return NULL;
+}
+
+static void mpc_input_memo_insert(mpc_input_t *i, mpc_memo_t *m) {
+  int k = mpc_input_memo_slot(i, m->p, m->pos);
+  while (i->memo[k].p) { k = (k + 1) & (i->memo_slots - 1); }
+  i->memo[k] = *m;
+}
+
+static int mpc_input_memo_full(mpc_input_t *i) {
+  return i->memo_num >= MPC_MEMO_MAX;
+}
+
+/* Stores `r`, which must be a copy, as the result of `p` from `pos` to the current state */
+static void mpc_input_memo_add(mpc_input_t *i, mpc_parser_t *p, int pos, int success, mpc_result_t r) {
+  
+  int k, slots;
+  mpc_memo_t m, *old;
+  
+  if ((i->memo_num + 1) * 2 > i->memo_slots) {
+    old = i->memo;
+    slots = i->memo_slots;
+    i->memo_slots = slots ? slots * 2 : 64;
+    i->memo = calloc(i->memo_slots, sizeof(mpc_memo_t));
+    for (k = 0; k < slots; k++) {
+      if (old[k].p) { mpc_input_memo_insert(i, &old[k]); }
+    }
+    free(old);
+  }
+  
+  m.p = p;
+  m.pos = pos;
+  m.mode = mpc_input_memo_mode(i);
+  m.success = success;
+  m.end = i->state;
+  m.r = r;
+  
+  mpc_input_memo_insert(i, &m);
+  i->memo_num++;
+}
+
+/* Stored results live in the arena and error pool of the parse, so are not freed here */
+static void mpc_input_memo_clear(mpc_input_t *i) {
+  free(i->memo);
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+}
+
 /*
 ** Parser Type
 */
@@ -629,7 +849,11 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_SPAN      = 25,
+  MPC_TYPE_DFA       = 26,
+  MPC_TYPE_MEMO      = 27
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -642,9 +866,17 @@ typedef struct { char *x; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_span_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
+typedef struct {
+  int states_num; int *table; char *accept;
+  int *excluded_num; unsigned char *excluded;
+  char soi; char eoi; mpc_parser_t *x;
+  int items_num; char **expected; int *leave;
+} mpc_pdata_dfa_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; int *predict; int *predict_ix; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
 typedef union {
@@ -658,6 +890,9 @@ typedef union {
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
+  mpc_pdata_span_t span;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -671,6 +906,146 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** DFA Matching
+**
+** Regular expressions without groups or
+** alternation are compiled into a table driven
+** DFA (see `mpc_re_dfa`). Each row of the table
+** gives the next state for every input byte, or
+** -1 to halt, and a match succeeds if it halts in
+** an accepting state.
+**
+** States which loop on themselves for all but a
+** few bytes, such as those of `[^"]*`, skip over
+** runs of input using SIMD comparisons where the
+** platform has them.
+**
+** Only string inputs are matched this way. When
+** the DFA does not match, the combinator form of
+** the regex is run instead, so that failures
+** still produce the usual error messages.
+*/
+
+#define MPC_DFA_EXCLUDED_MAX 3
+
+static size_t mpc_dfa_skip(mpc_pdata_dfa_t *d, int s, const char *x, size_t n) {
+  
+  const unsigned char *e = d->excluded + s * MPC_DFA_EXCLUDED_MAX;
+  const int *row = d->table + s * 256;
+  size_t k = 0;
+  
+#ifdef __SSE2__
+  int m;
+  __m128i c0, c1, c2, v, hit;
+  
+  if (d->excluded_num[s] > 0) {
+    c0 = _mm_set1_epi8((char)e[0]);
+    c1 = _mm_set1_epi8((char)e[d->excluded_num[s] > 1 ? 1 : 0]);
+    c2 = _mm_set1_epi8((char)e[d->excluded_num[s] > 2 ? 2 : 0]);
+    while (k + 16 <= n) {
+      v = _mm_loadu_si128((const __m128i*)(x + k));
+      hit = _mm_or_si128(_mm_cmpeq_epi8(v, c0),
+            _mm_or_si128(_mm_cmpeq_epi8(v, c1), _mm_cmpeq_epi8(v, c2)));
+      m = _mm_movemask_epi8(hit);
+      if (m) {
+        while (!(m & 1)) { m >>= 1; k++; }
+        return k;
+      }
+      k += 16;
+    }
+  }
+#else
+  (void)e;
+#endif
+  
+  while (k < n && row[(unsigned char)x[k]] == s) { k++; }
+  return k;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+  
+  const char *x;
+  int s = 0, pos, next, j;
+  
+  if (i->type != MPC_INPUT_STRING) { return 0; }
+  if (d->soi && i->state.pos != 0) { return 0; }
+  
+  pos = i->state.pos;
+  x = i->string;
+  
+  while ((size_t)pos < i->length) {
+    next = d->table[s * 256 + (unsigned char)x[pos]];
+    if (next < 0) { break; }
+    pos++;
+    if (next == s) {
+      pos += mpc_dfa_skip(d, s, x + pos, i->length - pos);
+    }
+    s = next;
+  }
+  
+  if (!d->accept[s]) { return 0; }
+  if (d->eoi && (size_t)pos != i->length) { return 0; }
+  
+  if (i->spans) {
+    *o = NULL;
+  } else {
+    *o = malloc(pos - i->state.pos + 1);
+    memcpy(*o, x + i->state.pos, pos - i->state.pos);
+    (*o)[pos - i->state.pos] = '\0';
+  }
+  
+  for (j = i->state.pos; j < pos; j++) {
+    if (x[j] == '\n') {
+      i->state.row++;
+      i->state.col = 0;
+    } else {
+      i->state.col++;
+    }
+  }
+  i->state.pos = pos;
+  i->state.next = (size_t)pos < i->length ? x[pos] : '\0';
+  
+  return 1;
+}
+
+/*
+** Lazy Errors
+**
+** Most failures are thrown away as soon as some
+** other alternative succeeds, so while parsing
+** they are kept as small records taken from a
+** pool, which point at strings owned by the
+** parsers rather than copying them. Merging two
+** failures splices their lists of expected items
+** together without removing duplicates.
+**
+** Only when the whole parse fails is an `mpc_err_t`
+** built from the final record, removing duplicates
+** and formatting repeats the same way as merging
+** full errors at each step would have.
+*/
+
+typedef struct mpc_expected_t {
+  const char *m;
+  int n;
+  struct mpc_expected_t *inner;
+  struct mpc_expected_t *next;
+} mpc_expected_t;
+
+typedef struct {
+  mpc_state_t state;
+  const char *failure;
+  mpc_expected_t *expected;
+  mpc_expected_t *expected_last;
+} mpc_fail_t;
+
+typedef struct mpc_pool_block_t {
+  struct mpc_pool_block_t *next;
+} mpc_pool_block_t;
+
+#define MPC_POOL_BLOCK_SIZE 16384
+
 /*
 ** Stack Type
 */
@@ -687,94 +1062,305 @@ typedef struct {
   mpc_result_t *results;
   int *returns;
   
-  mpc_err_t *err;
+  mpc_fail_t *err;
+  
+  mpc_pool_block_t *pool;
+  int pool_used;
   
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+static void *mpc_stack_alloc(mpc_stack_t *s, int n) {
   
-  s->parsers_num = 0;
-  s->parsers_slots = 0;
-  s->parsers = NULL;
-  s->states = NULL;
+  mpc_pool_block_t *b;
+  void *x;
   
-  s->results_num = 0;
-  s->results_slots = 0;
-  s->results = NULL;
-  s->returns = NULL;
+  n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  if (s->pool == NULL || s->pool_used + n > MPC_POOL_BLOCK_SIZE) {
+    b = malloc(sizeof(mpc_pool_block_t) + MPC_POOL_BLOCK_SIZE);
+    b->next = s->pool;
+    s->pool = b;
+    s->pool_used = 0;
+  }
   
-  return s;
+  x = (char*)(s->pool + 1) + s->pool_used;
+  s->pool_used += n;
+  return x;
 }
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-  mpc_err_t *errs[2];
-  errs[0] = s->err;
-  errs[1] = e;
-  s->err = mpc_err_or(errs, 2);
+static void mpc_stack_pool_free(mpc_stack_t *s) {
+  mpc_pool_block_t *b, *n;
+  for (b = s->pool; b; b = n) {
+    n = b->next;
+    free(b);
+  }
+  s->pool = NULL;
+  s->pool_used = 0;
 }
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-  int success = s->returns[0];
+static mpc_fail_t *mpc_fail_new(mpc_stack_t *s, mpc_state_t state, const char *failure, const char *expected) {
   
-  if (success) {
-    r->output = s->results[0].output;
-    mpc_err_delete(s->err);
-  } else {
-    mpc_stack_err(s, s->results[0].error);
-    r->error = s->err;
-  }
+  mpc_fail_t *f = mpc_stack_alloc(s, sizeof(mpc_fail_t));
+  f->state = state;
+  f->failure = failure;
+  f->expected = NULL;
+  f->expected_last = NULL;
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  if (expected) {
+    f->expected = mpc_stack_alloc(s, sizeof(mpc_expected_t));
+    f->expected->m = expected;
+    f->expected->n = 0;
+    f->expected->inner = NULL;
+    f->expected->next = NULL;
+    f->expected_last = f->expected;
+  }
   
-  return success;
+  return f;
 }
 
-/* Stack Parser Stuff */
-
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
-  s->states[s->parsers_num-1] = x;
+static void mpc_fail_splice(mpc_fail_t *f, mpc_fail_t *x) {
+  if (x->expected == NULL) { return; }
+  if (f->expected == NULL) { f->expected = x->expected; }
+  else { f->expected_last->next = x->expected; }
+  f->expected_last = x->expected_last;
 }
 
-static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
-  if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
+/* Merge `x` into `f`, keeping whichever got further, or both when equal */
+static mpc_fail_t *mpc_fail_or(mpc_fail_t *f, mpc_fail_t *x) {
+  if (x->state.pos > f->state.pos) { return x; }
+  if (x->state.pos < f->state.pos) { return f; }
+  if (f->failure) { return f; }
+  if (x->failure) { f->failure = x->failure; return f; }
+  mpc_fail_splice(f, x);
+  return f;
 }
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
+/* Group the expected items of `f` under a repeat, of `n` times or one or more if `n` is negative */
+static mpc_fail_t *mpc_fail_repeat(mpc_stack_t *s, mpc_fail_t *f, int n) {
+  
+  mpc_expected_t *e;
+  
+  if (f->failure) { return f; }
+  
+  e = mpc_stack_alloc(s, sizeof(mpc_expected_t));
+  e->m = NULL;
+  e->n = n;
+  e->inner = f->expected;
+  e->next = NULL;
+  f->expected = e;
+  f->expected_last = e;
+  return f;
 }
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
-  s->parsers_num++;
-  mpc_stack_parsers_reserve_more(s);
-  s->parsers[s->parsers_num-1] = p;
-  s->states[s->parsers_num-1] = 0;
+static mpc_expected_t *mpc_expected_copy(mpc_stack_t *s, mpc_expected_t *e, mpc_expected_t **last) {
+  
+  mpc_expected_t *head = NULL, *c, *inner_last;
+  
+  *last = NULL;
+  for (; e; e = e->next) {
+    c = mpc_stack_alloc(s, sizeof(mpc_expected_t));
+    c->m = e->m;
+    c->n = e->n;
+    c->inner = mpc_expected_copy(s, e->inner, &inner_last);
+    c->next = NULL;
+    if (*last) { (*last)->next = c; } else { head = c; }
+    *last = c;
+  }
+  
+  return head;
 }
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
-  s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
+static mpc_fail_t *mpc_fail_copy(mpc_stack_t *s, mpc_fail_t *f) {
+  mpc_fail_t *c = mpc_fail_new(s, f->state, f->failure, NULL);
+  c->expected = mpc_expected_copy(s, f->expected, &c->expected_last);
+  return c;
 }
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-  *p = s->parsers[s->parsers_num-1];
-  *st = s->states[s->parsers_num-1];
+static void mpc_err_add_expected_list(mpc_err_t *x, mpc_expected_t *e) {
+  
+  mpc_err_t inner;
+  char prefix[32];
+  char *m;
+  int i;
+  
+  for (; e; e = e->next) {
+    
+    if (e->m) {
+      if (!mpc_err_contains_expected(x, (char*)e->m)) { mpc_err_add_expected(x, (char*)e->m); }
+      continue;
+    }
+    
+    inner.expected_num = 0;
+    inner.expected = NULL;
+    mpc_err_add_expected_list(&inner, e->inner);
+    
+    if (e->n < 0) { strcpy(prefix, "one or more of "); }
+    else { sprintf(prefix, "%i of ", e->n); }
+    
+    m = mpc_err_repeat(&inner, prefix);
+    if (!mpc_err_contains_expected(x, m)) { mpc_err_add_expected(x, m); }
+    free(m);
+    
+    for (i = 0; i < inner.expected_num; i++) { free(inner.expected[i]); }
+    free(inner.expected);
+  }
+}
+
+static mpc_err_t *mpc_fail_build(mpc_fail_t *f, const char *filename) {
+  
+  mpc_err_t *x;
+  
+  if (f->failure) { return mpc_err_fail(filename, f->state, f->failure); }
+  
+  x = malloc(sizeof(mpc_err_t));
+  x->filename = malloc(strlen(filename) + 1);
+  strcpy(x->filename, filename);
+  x->state = f->state;
+  x->failure = NULL;
+  x->expected_num = 0;
+  x->expected = NULL;
+  mpc_err_add_expected_list(x, f->expected);
+  return x;
+}
+
+
+/*
+** Stacks start out big enough for most parses and
+** only ever grow, as shrinking them on every pop
+** cost more than it saved. Between parses a stack
+** can be reset and used again, keeping its memory.
+*/
+
+#define MPC_STACK_SLOTS 64
+
+static mpc_stack_t *mpc_stack_new(void) {
+  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+  
+  s->parsers_num = 0;
+  s->parsers_slots = MPC_STACK_SLOTS;
+  s->parsers = malloc(sizeof(mpc_parser_t*) * MPC_STACK_SLOTS);
+  s->states = malloc(sizeof(int) * MPC_STACK_SLOTS);
+  
+  s->results_num = 0;
+  s->results_slots = MPC_STACK_SLOTS;
+  s->results = malloc(sizeof(mpc_result_t) * MPC_STACK_SLOTS);
+  s->returns = malloc(sizeof(int) * MPC_STACK_SLOTS);
+  
+  s->pool = NULL;
+  s->pool_used = 0;
+  s->err = mpc_fail_new(s, mpc_state_invalid(), "Unknown Error", NULL);
+  
+  return s;
+}
+
+static void mpc_stack_reset(mpc_stack_t *s) {
+  
+  mpc_pool_block_t *b;
+  
+  s->parsers_num = 0;
+  s->results_num = 0;
+  
+  /* Keep one block of the pool for the next parse */
+  while (s->pool && s->pool->next) {
+    b = s->pool->next;
+    s->pool->next = b->next;
+    free(b);
+  }
+  s->pool_used = 0;
+  s->err = mpc_fail_new(s, mpc_state_invalid(), "Unknown Error", NULL);
+}
+
+static void mpc_stack_delete(mpc_stack_t *s) {
+  mpc_stack_pool_free(s);
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+  free(s);
+}
+
+static void mpc_stack_err(mpc_stack_t *s, mpc_fail_t *e) {
+  s->err = mpc_fail_or(s->err, e);
+}
+
+/*
+** A DFA match from `from` to the current input state
+** records the failures its combinator form would have:
+** where the match moves on to a later item, each item
+** left behind fails on that byte, and at the end each
+** remaining item fails. Failures behind the furthest
+** one so far are dropped, as merging would drop them.
+*/
+
+static void mpc_stack_err_dfa(mpc_stack_t *s, mpc_input_t *i, mpc_pdata_dfa_t *d, mpc_state_t from) {
+  
+  mpc_state_t at = from;
+  int q = 0, next, k;
+  
+  if (i->state.pos < s->err->state.pos) { return; }
+  
+  while (at.pos < i->state.pos) {
+    at.next = i->string[at.pos];
+    next = d->table[q * 256 + (unsigned char)at.next];
+    if (at.pos >= s->err->state.pos) {
+      for (k = d->leave[q]; k < next / 2; k++) {
+        mpc_stack_err(s, mpc_fail_new(s, at, NULL, d->expected[k]));
+      }
+    }
+    q = next;
+    if (at.next == '\n') { at.row++; at.col = 0; } else { at.col++; }
+    at.pos++;
+  }
+  
+  at.next = (size_t)at.pos < i->length ? i->string[at.pos] : '\0';
+  for (k = d->leave[q]; k < d->items_num; k++) {
+    mpc_stack_err(s, mpc_fail_new(s, at, NULL, d->expected[k]));
+  }
+}
+
+static int mpc_stack_terminate(mpc_stack_t *s, const char *filename, mpc_result_t *r) {
+  int success = s->returns[0];
+  
+  if (success) {
+    r->output = s->results[0].output;
+  } else {
+    mpc_stack_err(s, s->results[0].output);
+    r->error = mpc_fail_build(s->err, filename);
+  }
+  
+  return success;
+}
+
+/* Stack Parser Stuff */
+
+static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+  s->states[s->parsers_num-1] = x;
+}
+
+static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
+  if (s->parsers_num > s->parsers_slots) {
+    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
+    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+  }
+}
+
+static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+  s->parsers_num++;
+  mpc_stack_parsers_reserve_more(s);
+  s->parsers[s->parsers_num-1] = p;
+  s->states[s->parsers_num-1] = 0;
+}
+
+static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
+  s->parsers_num--;
+}
+
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+  *p = s->parsers[s->parsers_num-1];
+  *st = s->states[s->parsers_num-1];
 }
 
 static int mpc_stack_empty(mpc_stack_t *s) {
@@ -783,9 +1369,10 @@ static int mpc_stack_empty(mpc_stack_t *s) {
 
 /* Stack Result Stuff */
 
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
+/* While parsing, failed results hold an `mpc_fail_t` in place of an error */
+static mpc_result_t mpc_result_fail(mpc_fail_t *f) {
   mpc_result_t r;
-  r.error = e;
+  r.output = f;
   return r;
 }
 
@@ -803,14 +1390,6 @@ static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   }
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
 static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
   s->results_num++;
   mpc_stack_results_reserve_more(s);
@@ -823,7 +1402,6 @@ static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
   *x = s->results[s->results_num-1];
   r = s->returns[s->results_num-1];
   s->results_num--;
-  mpc_stack_results_reserve_less(s);
   return r;
 }
 
@@ -836,7 +1414,7 @@ static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
   mpc_result_t x;
   while (n) {
     mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
+    mpc_stack_err(s, x.output);
     n--;
   }
 }
@@ -873,8 +1451,25 @@ static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
   return x;
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+static mpc_fail_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
+  int k;
+  mpc_fail_t *x = s->results[s->results_num-n].output;
+  for (k = 1; k < n; k++) {
+    x = mpc_fail_or(x, s->results[s->results_num-n+k].output);
+  }
+  mpc_stack_popr_n(s, n);
+  return x;
+}
+
+/* Merges errors pushed in the order given by ix back into index order */
+static mpc_fail_t *mpc_stack_merger_err_order(mpc_stack_t *s, int n, int *ix) {
+  int j, k;
+  mpc_fail_t *x = NULL;
+  for (k = 0; k < n; k++) {
+    for (j = 0; ix[j] != k; j++);
+    x = k == 0 ? s->results[s->results_num-n+j].output
+               : mpc_fail_or(x, s->results[s->results_num-n+j].output);
+  }
   mpc_stack_popr_n(s, n);
   return x;
 }
@@ -900,21 +1495,27 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 ** But it is now a pretty ugly beast...
 */
 
+static void *mpc_ast_arena_begin(void);
+static void mpc_ast_arena_end(void *outer, int success, mpc_val_t *output);
+
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
 #define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_fail(x), 0); continue
+#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_fail_new(stk, i->state, "Incorrect Input", NULL)); }
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_parse_run(mpc_input_t *i, mpc_stack_t *stk, mpc_parser_t *init, mpc_result_t *final) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
   
   /* Variables */
   char *s;
   mpc_result_t r;
+  mpc_memo_t *m;
+  mpc_state_t from;
+  int success, c;
+  void *arena = mpc_ast_arena_begin();
 
   /* Go! */
   mpc_stack_pushp(stk, init);
@@ -927,9 +1528,9 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       /* Trivial Parsers */
 
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_fail_new(stk, i->state, "Parser Undefined!", NULL));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_fail_new(stk, i->state, p->data.fail.m, NULL));
       case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     
@@ -953,8 +1554,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(r.output);
           } else {
-            mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m));
+            MPC_FAILURE(mpc_fail_new(stk, i->state, NULL, p->data.expect.m));
           }
         }
       
@@ -964,7 +1564,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(p->data.apply.f(r.output));
           } else {
-            MPC_FAILURE(r.error);
+            MPC_FAILURE(r.output);
           }
         }
       
@@ -974,7 +1574,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
           } else {
-            MPC_FAILURE(r.error);
+            MPC_FAILURE(r.output);
           }
         }
       
@@ -986,6 +1586,70 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           continue;
         }
       
+      /*
+      ** The state of a span is one past the input
+      ** position it started at, so no separate
+      ** stack of start positions is needed.
+      */
+      
+      case MPC_TYPE_SPAN:
+        if (st == 0) { mpc_input_span_begin(i); MPC_CONTINUE(i->state.pos+1, p->data.span.x); }
+        if (st >  0) {
+          if (mpc_stack_popr(stk, &r)) {
+            free(r.output);
+            MPC_SUCCESS(mpc_input_span_end(i, st-1));
+          } else {
+            mpc_input_span_fail(i);
+            MPC_FAILURE(r.output);
+          }
+        }
+      
+      case MPC_TYPE_DFA:
+        from = i->state;
+        if (mpc_input_dfa(i, &p->data.dfa, &s)) {
+          mpc_stack_err_dfa(stk, i, &p->data.dfa, from);
+          MPC_SUCCESS(s);
+        }
+        mpc_stack_popp(stk, &p, &st);
+        mpc_stack_pushp(stk, p->data.dfa.x);
+        continue;
+      
+      /*
+      ** Like spans the state of a memo is one past
+      ** the position it started at. A hit restores
+      ** the input to where the stored result ended.
+      */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          if (i->type != MPC_INPUT_STRING) {
+            mpc_stack_popp(stk, &p, &st);
+            mpc_stack_pushp(stk, p->data.memo.x);
+            continue;
+          }
+          if ((m = mpc_input_memo_find(i, p))) {
+            mpc_memo_hits++;
+            i->state = m->end;
+            if (m->success) { MPC_SUCCESS(mpc_ast_copy(m->r.output)); }
+            else { MPC_FAILURE(mpc_fail_copy(stk, m->r.output)); }
+          }
+          mpc_memo_misses++;
+          MPC_CONTINUE(i->state.pos+1, p->data.memo.x);
+        }
+        if (st >  0) {
+          if (mpc_stack_popr(stk, &r)) {
+            if (!mpc_input_memo_full(i)) {
+              mpc_input_memo_add(i, p, st-1, 1, mpc_result_out(mpc_ast_copy(r.output)));
+            }
+            MPC_SUCCESS(r.output);
+          } else {
+            if (!mpc_input_memo_full(i)) {
+              mpc_input_memo_add(i, p, st-1, 0, mpc_result_fail(mpc_fail_copy(stk, r.output)));
+            }
+            MPC_FAILURE(r.output);
+          }
+        }
+      
       /* Optional Parsers */
       
       /* TODO: Update Not Error Message */
@@ -996,10 +1660,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
             p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite"));
+            MPC_FAILURE(mpc_fail_new(stk, i->state, NULL, "opposite"));
           } else {
             mpc_input_unmark(i);
-            mpc_stack_err(stk, r.error);
+            mpc_stack_err(stk, r.output);
             MPC_SUCCESS(p->data.not.lf());
           }
         }
@@ -1010,7 +1674,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(r.output);
           } else {
-            mpc_stack_err(stk, r.error);
+            mpc_stack_err(stk, r.output);
             MPC_SUCCESS(p->data.not.lf());
           }
         }
@@ -1024,7 +1688,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             mpc_stack_popr(stk, &r);
-            mpc_stack_err(stk, r.error);
+            mpc_stack_err(stk, r.output);
             MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
           }
         }
@@ -1037,10 +1701,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             if (st == 1) {
               mpc_stack_popr(stk, &r);
-              MPC_FAILURE(mpc_err_many1(r.error));
+              MPC_FAILURE(mpc_fail_repeat(stk, r.output, -1));
             } else {
               mpc_stack_popr(stk, &r);
-              mpc_stack_err(stk, r.error);
+              mpc_stack_err(stk, r.output);
               MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
             }
           }
@@ -1056,10 +1720,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
               mpc_stack_popr(stk, &r);
               mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
               mpc_input_rewind(i);
-              MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+              MPC_FAILURE(mpc_fail_repeat(stk, r.output, p->data.repeat.n));
             } else {
               mpc_stack_popr(stk, &r);
-              mpc_stack_err(stk, r.error);
+              mpc_stack_err(stk, r.output);
               mpc_input_unmark(i);
               MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
             }
@@ -1072,6 +1736,36 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
+        /*
+        ** With a prediction table the alternatives
+        ** whose first set holds the next byte are tried
+        ** first, counting the state down from -1. Only
+        ** if they all fail are the rest tried, and their
+        ** errors merged back in the original order.
+        */
+        
+        if (st == 0 && p->data.or.predict
+        &&  i->type == MPC_INPUT_STRING && (size_t)i->state.pos < i->length) {
+          c = (unsigned char)i->string[i->state.pos];
+          if (p->data.or.predict[c*2+1] > 0) {
+            MPC_CONTINUE(-1, p->data.or.xs[p->data.or.predict_ix[p->data.or.predict[c*2]]]);
+          }
+        }
+        
+        if (st < 0) {
+          if (mpc_stack_peekr(stk, &r)) {
+            mpc_stack_popr(stk, &r);
+            mpc_stack_popr_err(stk, -st-1);
+            MPC_SUCCESS(r.output);
+          }
+          c = (unsigned char)i->string[i->state.pos];
+          if (-st < p->data.or.n) {
+            MPC_CONTINUE(st-1, p->data.or.xs[p->data.or.predict_ix[p->data.or.predict[c*2]-st]]);
+          }
+          MPC_FAILURE(mpc_stack_merger_err_order(stk, p->data.or.n,
+            p->data.or.predict_ix + p->data.or.predict[c*2]));
+        }
+        
         if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
         if (st <= p->data.or.n) {
           if (mpc_stack_peekr(stk, &r)) {
@@ -1093,7 +1787,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             mpc_input_rewind(i);
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
-            MPC_FAILURE(r.error);
+            MPC_FAILURE(r.output);
           }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
           if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
@@ -1103,14 +1797,27 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(mpc_fail_new(stk, i->state, "Unknown Parser Type Id!", NULL));
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  /* Stored results live in the arena and error pool, so go before they do */
+  mpc_input_memo_clear(i);
+  
+  success = mpc_stack_terminate(stk, i->filename, final);
+  mpc_ast_arena_end(arena, success, success ? final->output : NULL);
+  return success;
   
 }
 
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  int x;
+  mpc_stack_t *stk = mpc_stack_new();
+  x = mpc_parse_run(i, stk, init, final);
+  mpc_stack_delete(stk);
+  return x;
+}
+
 #undef MPC_CONTINUE
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
@@ -1124,6 +1831,58 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** Parse Contexts
+**
+** A context keeps the stack, error pool and input
+** of a parse between parses, so that parsing many
+** small strings in a row allocates nothing for
+** them once it has warmed up, beyond the output
+** itself or the error. A context must not be used
+** by two parses at once.
+*/
+
+struct mpc_ctx_t {
+  mpc_stack_t *stk;
+  mpc_input_t input;
+};
+
+mpc_ctx_t *mpc_ctx_new(void) {
+  mpc_ctx_t *c = malloc(sizeof(mpc_ctx_t));
+  c->stk = mpc_stack_new();
+  c->input.marks_slots = 0;
+  c->input.marks = NULL;
+  return c;
+}
+
+void mpc_ctx_delete(mpc_ctx_t *c) {
+  mpc_stack_delete(c->stk);
+  free(c->input.marks);
+  free(c);
+}
+
+int mpc_ctx_nparse(mpc_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  
+  /* The filename is only read during the parse, so need not be copied */
+  c->input.filename = (char*)filename;
+  mpc_input_set_nstring(&c->input, string, length);
+  mpc_stack_reset(c->stk);
+  
+  return mpc_parse_run(&c->input, c->stk, p, r);
+}
+
+int mpc_ctx_parse(mpc_ctx_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_ctx_nparse(c, filename, string, strlen(string), p, r);
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1140,17 +1899,54 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** Where the platform allows it regular files are
+** memory mapped and parsed as one contiguous
+** string, which makes backtracking free. Other
+** files such as pipes cannot be seeked and so
+** are parsed as streams with a pipe input.
+*/
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
   int res;
   
+#ifdef MPC_USE_MMAP
+  struct stat st;
+  void *m;
+#endif
+  
   if (f == NULL) {
     r->output = NULL;
     r->error = mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
     return 0;
   }
   
+#ifdef MPC_USE_MMAP
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+    
+    if (st.st_size == 0) {
+      res = mpc_nparse(filename, "", 0, p, r);
+      fclose(f);
+      return res;
+    }
+    
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (m != MAP_FAILED) {
+      res = mpc_nparse(filename, m, st.st_size, p, r);
+      munmap(m, st.st_size);
+      fclose(f);
+      return res;
+    }
+  
+  } else {
+    res = mpc_parse_pipe(filename, f, p, r);
+    fclose(f);
+    return res;
+  }
+#endif
+  
   res = mpc_parse_file(filename, f, p, r);
   fclose(f);
   return res;
@@ -1169,6 +1965,8 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.predict);
+  free(p->data.or.predict_ix);
   
 }
 
@@ -1185,6 +1983,8 @@ static void mpc_undefine_and(mpc_parser_t *p) {
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
+  int j;
+  
   if (p->retained && !force) { return; }
   
   switch (p->type) {
@@ -1200,6 +2000,19 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_SPAN:     mpc_undefine_unretained(p->data.span.x, 0);     break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      free(p->data.dfa.table);
+      free(p->data.dfa.accept);
+      free(p->data.dfa.excluded_num);
+      free(p->data.dfa.excluded);
+      for (j = 0; j < p->data.dfa.items_num; j++) { free(p->data.dfa.expected[j]); }
+      free(p->data.dfa.expected);
+      free(p->data.dfa.leave);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1500,6 +2313,13 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_span(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SPAN;
+  p->data.span.x = a;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1858,23 +2678,15 @@ static char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+/* Expand the body of a regex range, starting at `from`, into its characters */
+static char *mpc_re_range_chars(const char *s, int from) {
   
-  mpc_parser_t *out;
   char *range = calloc(1,1);
   char *tmp = NULL;
-  char *s = x;
   char start, end;
   int i, j;
-  int comp = 0;
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  
-  if (s[0] == '^') { comp = 1;}
-  
-  for (i = comp; i < strlen(s); i++){
+  for (i = from; i < strlen(s); i++){
     
     /* Regex Range Escape */
     if (s[i] == '\\') {
@@ -1915,6 +2727,23 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   }
   
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  char *range;
+  char *s = x;
+  int comp = 0;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  if (s[0] == '^') { comp = 1;}
+  
+  range = mpc_re_range_chars(s, comp);
   out = comp ? mpc_noneof(range) : mpc_oneof(range);
   
   free(x);
@@ -1923,17 +2752,263 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+/*
+** Regex DFA Compiler
+**
+** Regexes made of a flat sequence of characters,
+** escapes, ranges and `.`, each with an optional
+** `*`, `+` or `?`, and with an optional leading `^`
+** and trailing `$`, are compiled into a DFA. As in
+** the combinator form repeats are possessive, so
+** matching never backtracks and two states per
+** item (not yet matched, matched) are enough.
+**
+** Character sets copy the combinators exactly,
+** including that `oneof` accepts a NUL byte in the
+** input and `noneof` rejects it.
+*/
+
+typedef struct {
+  unsigned char set[32];
+  char repeat;
+  char *expected;
+} mpc_re_item_t;
+
+static void mpc_re_item_chars(mpc_re_item_t *it, const char *c) {
+  int j;
+  for (j = 0; j < strlen(c); j++) {
+    it->set[(unsigned char)c[j] / 8] |= 1 << ((unsigned char)c[j] % 8);
+  }
+}
+
+static void mpc_re_item_oneof(mpc_re_item_t *it, const char *c) {
+  mpc_re_item_chars(it, c);
+  it->set[0] |= 1;
+}
+
+static void mpc_re_item_noneof(mpc_re_item_t *it, const char *c) {
+  int j;
+  mpc_re_item_chars(it, c);
+  for (j = 0; j < 32; j++) { it->set[j] = ~it->set[j]; }
+  it->set[0] &= ~1;
+}
+
+static int mpc_re_item_has(mpc_re_item_t *it, int b) {
+  return it->set[b / 8] & (1 << (b % 8));
+}
+
+static int mpc_re_item_more(mpc_re_item_t *it, int matched) {
+  return it->repeat == '*' || it->repeat == '+' || !matched;
+}
+
+static int mpc_re_item_done(mpc_re_item_t *it, int matched) {
+  return it->repeat == '*' || it->repeat == '?' || matched;
+}
+
+static int mpc_re_item_range(mpc_re_item_t *it, const char *re, int len) {
   
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  char *body, *range;
+  int comp = re[0] == '^';
   
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
+  if (len - comp == 0) { return 0; }
+  
+  body = malloc(len + 1);
+  memcpy(body, re, len);
+  body[len] = '\0';
+  
+  range = mpc_re_range_chars(body, comp);
+  if (comp) { mpc_re_item_noneof(it, range); }
+  else      { mpc_re_item_oneof(it, range); }
+  
+  free(range);
+  free(body);
+  return 1;
+}
+
+static int mpc_re_item_escape(mpc_re_item_t *it, char c) {
+  switch (c) {
+    case 'A': case 'Z': case 'D': case 'S': case 'W': case '\0': return 0;
+    case 'a': c = '\a'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case 'b': c = '\b'; break;
+    case 'd': mpc_re_item_oneof(it, "012345689"); return 1;
+    case 's': mpc_re_item_oneof(it, " \f\n\r\t\v"); return 1;
+    case 'w':
+      mpc_re_item_oneof(it, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ012345689_");
+      return 1;
+    default: break;
+  }
+  it->set[(unsigned char)c / 8] |= 1 << ((unsigned char)c % 8);
+  return 1;
+}
+
+/*
+** The message an item fails with, taken from the
+** combinator it stands for. Only an `expect` around
+** a single primitive fails without recording more,
+** so anything else (such as `\w`) gets no DFA.
+*/
+
+static char *mpc_re_item_expected(const char *re, int len) {
+  
+  mpc_parser_t *p, *x;
+  char *body, *m = NULL;
+  int from = re[0] == '[';
+  
+  body = malloc(len + 1);
+  memcpy(body, re + from, len - 2 * from);
+  body[len - 2 * from] = '\0';
+  
+  p = from ? mpcf_re_range(body) : mpcf_re_escape(body);
+  
+  x = p;
+  while (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  
+  if (p->type == MPC_TYPE_EXPECT
+  && (x->type == MPC_TYPE_ANY || x->type == MPC_TYPE_SINGLE
+  ||  x->type == MPC_TYPE_ONEOF || x->type == MPC_TYPE_NONEOF)) {
+    m = malloc(strlen(p->data.expect.m) + 1);
+    strcpy(m, p->data.expect.m);
+  }
+  
+  mpc_delete(p);
+  return m;
+}
+
+static mpc_re_item_t *mpc_re_items(const char *re, int *num, char *soi, char *eoi) {
+  
+  mpc_re_item_t *items = NULL, *it;
+  int i = 0, start, first, j;
+  
+  *num = 0; *soi = 0; *eoi = 0;
+  
+  if (re[i] == '^') { *soi = 1; i++; }
+  
+  while (re[i] != '\0') {
+    
+    if (re[i] == '$' && re[i+1] == '\0') { *eoi = 1; break; }
+    if (strchr("()|*+?{^$", re[i])) { goto fail; }
+    
+    items = realloc(items, sizeof(mpc_re_item_t) * (*num + 1));
+    it = &items[(*num)++];
+    memset(it, 0, sizeof(mpc_re_item_t));
+    first = i;
+    
+    if (re[i] == '.') {
+      memset(it->set, 0xFF, sizeof(it->set));
+      i++;
+    } else if (re[i] == '[') {
+      start = ++i;
+      while (re[i] != ']') {
+        if (re[i] == '\0') { goto fail; }
+        if (re[i] == '\\' && re[i+1] != '\0') { i++; }
+        i++;
+      }
+      if (!mpc_re_item_range(it, re + start, i - start)) { goto fail; }
+      i++;
+    } else if (re[i] == '\\') {
+      if (!mpc_re_item_escape(it, re[i+1])) { goto fail; }
+      i += 2;
+    } else {
+      it->set[(unsigned char)re[i] / 8] |= 1 << ((unsigned char)re[i] % 8);
+      i++;
+    }
+    
+    it->expected = mpc_re_item_expected(re + first, i - first);
+    if (it->expected == NULL) { goto fail; }
+    
+    if (re[i] == '*' || re[i] == '+' || re[i] == '?') { it->repeat = re[i++]; }
+  }
+  
+  if (items == NULL) { items = malloc(sizeof(mpc_re_item_t)); }
+  return items;
+  
+fail:
+  for (j = 0; j < *num; j++) { free(items[j].expected); }
+  free(items);
+  return NULL;
+}
+
+/* State for item `k`, which has matched if `m`, reached on byte `b`, or -1 */
+static int mpc_re_dfa_step(mpc_re_item_t *items, int num, int k, int m, int b) {
+  while (k < num) {
+    if (mpc_re_item_more(&items[k], m) && mpc_re_item_has(&items[k], b)) { return k * 2 + 1; }
+    if (!mpc_re_item_done(&items[k], m)) { return -1; }
+    k++; m = 0;
+  }
+  return -1;
+}
+
+static int mpc_re_dfa_accept(mpc_re_item_t *items, int num, int k, int m) {
+  for (; k < num; k++, m = 0) {
+    if (!mpc_re_item_done(&items[k], m)) { return 0; }
+  }
+  return 1;
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re, mpc_parser_t *x) {
+  
+  mpc_parser_t *p;
+  mpc_pdata_dfa_t *d;
+  mpc_re_item_t *items;
+  int num, s, b, n;
+  char soi, eoi;
+  
+  items = mpc_re_items(re, &num, &soi, &eoi);
+  if (items == NULL) { return x; }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  d = &p->data.dfa;
+  d->states_num = num * 2 + 1;
+  d->table = malloc(sizeof(int) * d->states_num * 256);
+  d->accept = malloc(d->states_num);
+  d->excluded_num = malloc(sizeof(int) * d->states_num);
+  d->excluded = calloc(d->states_num, MPC_DFA_EXCLUDED_MAX);
+  d->soi = soi;
+  d->eoi = eoi;
+  d->x = x;
+  d->items_num = num;
+  d->expected = malloc(sizeof(char*) * (num + 1));
+  d->leave = malloc(sizeof(int) * d->states_num);
+  
+  for (s = 0; s < num; s++) { d->expected[s] = items[s].expected; }
+  
+  for (s = 0; s < d->states_num; s++) {
+    
+    d->accept[s] = mpc_re_dfa_accept(items, num, s / 2, s % 2);
+    d->leave[s] = s / 2 < num && mpc_re_item_more(&items[s / 2], s % 2) ? s / 2 : s / 2 + 1;
+    
+    n = 0;
+    for (b = 0; b < 256; b++) {
+      d->table[s * 256 + b] = mpc_re_dfa_step(items, num, s / 2, s % 2, b);
+      if (d->table[s * 256 + b] == s) { continue; }
+      if (n < MPC_DFA_EXCLUDED_MAX) { d->excluded[s * MPC_DFA_EXCLUDED_MAX + n] = b; }
+      n++;
+    }
+    d->excluded_num[s] = n <= MPC_DFA_EXCLUDED_MAX ? n : -1;
+  }
+  
+  free(items);
+  return p;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  
+  char *err_msg;
+  int ok;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
   Range  = mpc_new("range");
   
   mpc_define(Regex, mpc_and(2, 
@@ -1969,7 +3044,8 @@ mpc_parser_t *mpc_re(const char *re) {
   
   RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
   
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+  ok = mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r);
+  if (!ok) {
     err_msg = mpc_err_string(r.error);
     err_out = mpc_failf("Invalid Regex: %s", err_msg);
     mpc_err_delete(r.error);  
@@ -1980,7 +3056,8 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
-  return r.output;
+  /* A regex outputs exactly the input it matched */
+  return ok ? mpc_re_dfa(re, mpc_span(r.output)) : mpc_span(r.output);
   
 }
 
@@ -2174,14 +3251,35 @@ mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0)
 mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
+/*
+** Missing strings, such as the outputs inside a
+** span, are treated as empty. The result is sized
+** up front so folding is linear in its length.
+*/
+
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  
   int i;
+  size_t l = 0;
+  char *x, *o;
+  
+  for (i = 0; i < n; i++) {
+    if (xs[i]) { l += strlen(xs[i]); }
+  }
+  
+  x = malloc(l + 1);
+  o = x;
+  
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
-    free(xs[i]);
+    if (xs[i]) {
+      l = strlen(xs[i]);
+      memcpy(o, xs[i], l);
+      o += l;
+      free(xs[i]);
+    }
   }
+  *o = '\0';
+  
   return x;
 }
 
@@ -2289,6 +3387,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2384,39 +3485,337 @@ int mpc_match(mpc_parser_t *p, const char *s, void *d,
 ** AST
 */
 
+/*
+** Tags are interned so that each distinct tag
+** string is stored once and given an integer id.
+** Adding a tag to a node looks up the combined
+** tag by the pair of ids, so the tags of a parse
+** are built without any string concatenation
+** once each combination has been seen.
+**
+** The tables are shared by all threads, so they
+** are only touched with `mpc_tags_lock` held.
+*/
+
+#if defined(_WIN32)
+static SRWLOCK mpc_tags_lock = SRWLOCK_INIT;
+static void mpc_tags_acquire(void) { AcquireSRWLockExclusive(&mpc_tags_lock); }
+static void mpc_tags_release(void) { ReleaseSRWLockExclusive(&mpc_tags_lock); }
+#else
+static pthread_mutex_t mpc_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+static void mpc_tags_acquire(void) { pthread_mutex_lock(&mpc_tags_lock); }
+static void mpc_tags_release(void) { pthread_mutex_unlock(&mpc_tags_lock); }
+#endif
+
+static char **mpc_tags = NULL;
+static int mpc_tags_num = 0;
+static int *mpc_tags_table = NULL;
+static int mpc_tags_table_slots = 0;
+
+typedef struct { int prefix; int tag; int joined; } mpc_tag_pair_t;
+
+static mpc_tag_pair_t *mpc_tag_pairs = NULL;
+static int mpc_tag_pairs_num = 0;
+static int mpc_tag_pairs_slots = 0;
+
+static unsigned long mpc_tag_hash(const char *t) {
+  unsigned long h = 5381;
+  while (*t) { h = h * 33 + (unsigned char)*t++; }
+  return h;
+}
+
+static void mpc_tag_table_insert(int id) {
+  int k = (int)(mpc_tag_hash(mpc_tags[id]) & (mpc_tags_table_slots - 1));
+  while (mpc_tags_table[k]) { k = (k + 1) & (mpc_tags_table_slots - 1); }
+  mpc_tags_table[k] = id + 1;
+}
+
+static int mpc_tag_intern(const char *t) {
+  
+  int k, id;
+  
+  if (mpc_tags_table_slots) {
+    k = (int)(mpc_tag_hash(t) & (mpc_tags_table_slots - 1));
+    while (mpc_tags_table[k]) {
+      if (strcmp(mpc_tags[mpc_tags_table[k]-1], t) == 0) { return mpc_tags_table[k]-1; }
+      k = (k + 1) & (mpc_tags_table_slots - 1);
+    }
+  }
+  
+  if ((mpc_tags_num + 1) * 2 > mpc_tags_table_slots) {
+    free(mpc_tags_table);
+    mpc_tags_table_slots = mpc_tags_table_slots ? mpc_tags_table_slots * 2 : 64;
+    mpc_tags_table = calloc(mpc_tags_table_slots, sizeof(int));
+    mpc_tags = realloc(mpc_tags, sizeof(char*) * mpc_tags_table_slots / 2);
+    for (id = 0; id < mpc_tags_num; id++) { mpc_tag_table_insert(id); }
+  }
+  
+  id = mpc_tags_num++;
+  mpc_tags[id] = malloc(strlen(t) + 1);
+  strcpy(mpc_tags[id], t);
+  mpc_tag_table_insert(id);
+  return id;
+}
+
+static int mpc_tag_join(int prefix, int tag) {
+  
+  int k, slots;
+  mpc_tag_pair_t *old;
+  char *joined;
+  
+  if (mpc_tag_pairs_slots) {
+    k = (int)(((unsigned long)prefix * 40503UL + tag) & (mpc_tag_pairs_slots - 1));
+    while (mpc_tag_pairs[k].joined) {
+      if (mpc_tag_pairs[k].prefix == prefix && mpc_tag_pairs[k].tag == tag) {
+        return mpc_tag_pairs[k].joined - 1;
+      }
+      k = (k + 1) & (mpc_tag_pairs_slots - 1);
+    }
+  }
+  
+  if ((mpc_tag_pairs_num + 1) * 2 > mpc_tag_pairs_slots) {
+    old = mpc_tag_pairs;
+    slots = mpc_tag_pairs_slots;
+    mpc_tag_pairs_slots = slots ? slots * 2 : 64;
+    mpc_tag_pairs = calloc(mpc_tag_pairs_slots, sizeof(mpc_tag_pair_t));
+    mpc_tag_pairs_num = 0;
+    for (k = 0; k < slots; k++) {
+      if (old[k].joined) { mpc_tag_join(old[k].prefix, old[k].tag); }
+    }
+    free(old);
+  }
+  
+  joined = malloc(strlen(mpc_tags[prefix]) + 1 + strlen(mpc_tags[tag]) + 1);
+  strcpy(joined, mpc_tags[prefix]);
+  strcat(joined, "|");
+  strcat(joined, mpc_tags[tag]);
+  
+  k = (int)(((unsigned long)prefix * 40503UL + tag) & (mpc_tag_pairs_slots - 1));
+  while (mpc_tag_pairs[k].joined) { k = (k + 1) & (mpc_tag_pairs_slots - 1); }
+  mpc_tag_pairs[k].prefix = prefix;
+  mpc_tag_pairs[k].tag = tag;
+  mpc_tag_pairs[k].joined = mpc_tag_intern(joined) + 1;
+  mpc_tag_pairs_num++;
+  
+  free(joined);
+  return mpc_tag_pairs[k].joined - 1;
+}
+
+static void mpc_ast_set_tag(mpc_ast_t *a, int id) {
+  a->tag_id = id;
+  a->tag = mpc_tags[id];
+}
+
+/*
+** Nodes built while a parse is running come from
+** an arena belonging to that parse. Discarded
+** nodes are never freed one by one. When the parse
+** ends the arena either becomes owned by the AST
+** it output, and is freed in one go when that AST
+** is deleted, or is freed straight away.
+**
+** Nodes made outside of a parse are allocated
+** individually as before, and the two kinds can
+** be mixed freely when building trees by hand.
+*/
+
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t used;
+  size_t size;
+} mpc_ast_block_t;
+
+typedef struct mpc_ast_arena_t {
+  mpc_ast_block_t *blocks;
+  mpc_ast_t *root;
+  int foreign;
+} mpc_ast_arena_t;
+
+#define MPC_AST_BLOCK_SIZE 65536
+
+static MPC_THREAD_LOCAL mpc_ast_arena_t *mpc_ast_arena = NULL;
+static MPC_THREAD_LOCAL int mpc_ast_arena_depth = 0;
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *ar, size_t n) {
+  
+  mpc_ast_block_t *b = ar->blocks;
+  size_t size;
+  void *x;
+  
+  n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  
+  if (b == NULL || b->used + n > b->size) {
+    size = n > MPC_AST_BLOCK_SIZE ? n : MPC_AST_BLOCK_SIZE;
+    b = malloc(sizeof(mpc_ast_block_t) + size);
+    b->next = ar->blocks;
+    b->used = 0;
+    b->size = size;
+    ar->blocks = b;
+  }
+  
+  x = (char*)(b + 1) + b->used;
+  b->used += n;
+  return x;
+}
+
+static int mpc_ast_arena_contains(mpc_ast_arena_t *ar, void *x) {
+  mpc_ast_block_t *b;
+  for (b = ar->blocks; b; b = b->next) {
+    if ((char*)x >= (char*)(b + 1) && (char*)x < (char*)(b + 1) + b->used) { return 1; }
+  }
+  return 0;
+}
+
+static void mpc_ast_arena_free(mpc_ast_arena_t *ar) {
+  mpc_ast_block_t *b, *n;
+  for (b = ar->blocks; b; b = n) {
+    n = b->next;
+    free(b);
+  }
+  free(ar);
+}
+
+static mpc_ast_arena_t *mpc_ast_arena_current(void) {
+  if (mpc_ast_arena == NULL) {
+    mpc_ast_arena = malloc(sizeof(mpc_ast_arena_t));
+    mpc_ast_arena->blocks = NULL;
+    mpc_ast_arena->root = NULL;
+    mpc_ast_arena->foreign = 0;
+  }
+  return mpc_ast_arena;
+}
+
+static void *mpc_ast_arena_begin(void) {
+  void *outer = mpc_ast_arena;
+  mpc_ast_arena = NULL;
+  mpc_ast_arena_depth++;
+  return outer;
+}
+
+static void mpc_ast_arena_end(void *outer, int success, mpc_val_t *output) {
+  
+  mpc_ast_arena_t *ar = mpc_ast_arena;
+  mpc_ast_arena = outer;
+  mpc_ast_arena_depth--;
+  
+  if (ar == NULL) { return; }
+  
+  if (success && output
+  && mpc_ast_arena_contains(ar, output)
+  && ((mpc_ast_t*)output)->arena == ar) {
+    ar->root = output;
+  } else {
+    mpc_ast_arena_free(ar);
+  }
+}
+
+static void mpc_ast_children_reserve(mpc_ast_t *a, int n) {
+  
+  mpc_ast_t **children;
+  int slots = 1;
+  
+  while (slots < n) { slots *= 2; }
+  
+  if (a->arena) {
+    children = mpc_ast_arena_alloc(a->arena, sizeof(mpc_ast_t*) * slots);
+    if (a->children_num) { memcpy(children, a->children, sizeof(mpc_ast_t*) * a->children_num); }
+    a->children = children;
+  } else {
+    a->children = realloc(a->children, sizeof(mpc_ast_t*) * slots);
+  }
+}
+
+/* Children arrays hold the next power of two number of slots */
+static int mpc_ast_children_full(mpc_ast_t *a) {
+  return (a->children_num & (a->children_num - 1)) == 0;
+}
+
+static void mpc_ast_push_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->arena && (a == NULL || a->arena != r->arena)) {
+    ((mpc_ast_arena_t*)r->arena)->foreign = 1;
+  }
+  r->children[r->children_num++] = a;
+}
+
+static void mpc_ast_delete_foreign(mpc_ast_t *a, mpc_ast_arena_t *ar) {
+  int i;
+  for (i = 0; i < a->children_num; i++) {
+    if (a->children[i]->arena == ar) { mpc_ast_delete_foreign(a->children[i], ar); }
+    else { mpc_ast_delete(a->children[i]); }
+  }
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
+  mpc_ast_arena_t *ar;
   
   if (a == NULL) { return; }
+  
+  if (a->arena) {
+    ar = a->arena;
+    if (ar->root != a) { return; }
+    if (ar->foreign) { mpc_ast_delete_foreign(a, ar); }
+    mpc_ast_arena_free(ar);
+    return;
+  }
+  
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
   
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
   
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new("", a->contents);
+  mpc_tags_acquire();
+  mpc_ast_set_tag(b, a->tag_id);
+  mpc_tags_release();
+  if (a->children_num) { mpc_ast_children_reserve(b, a->children_num); }
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  b->children_num = a->children_num;
+  
+  return b;
+}
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_arena_t *ar = mpc_ast_arena_depth > 0 ? mpc_ast_arena_current() : NULL;
+  mpc_ast_t *a;
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  if (ar) {
+    a = mpc_ast_arena_alloc(ar, sizeof(mpc_ast_t));
+    a->contents = mpc_ast_arena_alloc(ar, strlen(contents) + 1);
+  } else {
+    a = malloc(sizeof(mpc_ast_t));
+    a->contents = malloc(strlen(contents) + 1);
+  }
   
-  a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
+  mpc_tags_acquire();
+  mpc_ast_set_tag(a, mpc_tag_intern(tag));
+  mpc_tags_release();
   
+  a->arena = ar;
   a->children_num = 0;
   a->children = NULL;
   return a;
@@ -2458,7 +3857,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
 
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (a->tag_id != b->tag_id) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
   
@@ -2470,24 +3869,23 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
+  if (mpc_ast_children_full(r)) { mpc_ast_children_reserve(r, r->children_num + 1); }
+  mpc_ast_push_child(r, a);
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  mpc_tags_acquire();
+  mpc_ast_set_tag(a, mpc_tag_join(mpc_tag_intern(t), a->tag_id));
+  mpc_tags_release();
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  mpc_tags_acquire();
+  mpc_ast_set_tag(a, mpc_tag_intern(t));
+  mpc_tags_release();
   return a;
 }
 
@@ -2514,9 +3912,9 @@ void mpc_ast_print(mpc_ast_t *a) {
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
-  int i, j;
+  int i, j, total = 0;
   mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_val_t *r;
+  mpc_ast_t *r;
   
   if (n == 0) { return NULL; }
   if (n == 1) { return xs[0]; }
@@ -2525,25 +3923,27 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
   r = mpc_ast_new(">", "");
   
+  /* Size the children once rather than growing per child */
   for (i = 0; i < n; i++) {
-    
     if (as[i] == NULL) { continue; }
+    total += as[i]->children_num > 0 ? as[i]->children_num : 1;
+  }
+  if (total > 0) { mpc_ast_children_reserve(r, total); }
+  
+  for (i = 0; i < n; i++) {
     
-    /*
-    printf("%i\n", i);
-    mpc_ast_print(as[i]);
-    */
+    if (as[i] == NULL) { continue; }
     
-    if (as[i] && as[i]->children_num > 0) {
+    if (as[i]->children_num > 0) {
       
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_push_child(r, as[i]->children[j]);
       }
       
       mpc_ast_delete_no_children(as[i]);
       
-    } else if (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
+    } else {
+      mpc_ast_push_child(r, as[i]);
     }
   
   }
@@ -2623,6 +4023,650 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
+/*
+** Parser Sets
+**
+** Passes over a grammar need to visit each parser
+** once even though rules refer to each other in
+** cycles. A parser set numbers the parsers it has
+** been given, looking them up by address.
+*/
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **parsers;
+  int table_slots;
+  int *table;
+} mpc_pset_t;
+
+static void mpc_pset_init(mpc_pset_t *s) {
+  int j;
+  s->num = 0;
+  s->slots = 64;
+  s->parsers = malloc(sizeof(mpc_parser_t*) * s->slots);
+  s->table_slots = 128;
+  s->table = malloc(sizeof(int) * s->table_slots);
+  for (j = 0; j < s->table_slots; j++) { s->table[j] = -1; }
+}
+
+static void mpc_pset_clear(mpc_pset_t *s) {
+  free(s->parsers);
+  free(s->table);
+}
+
+static unsigned long mpc_pset_hash(mpc_parser_t *p) {
+  unsigned long h = (unsigned long)p;
+  return (h >> 4) ^ (h >> 12);
+}
+
+static int mpc_pset_find(mpc_pset_t *s, mpc_parser_t *p) {
+  int j = mpc_pset_hash(p) & (s->table_slots-1);
+  while (s->table[j] != -1) {
+    if (s->parsers[s->table[j]] == p) { return s->table[j]; }
+    j = (j+1) & (s->table_slots-1);
+  }
+  return -1;
+}
+
+static void mpc_pset_insert(mpc_pset_t *s, int k) {
+  int j = mpc_pset_hash(s->parsers[k]) & (s->table_slots-1);
+  while (s->table[j] != -1) { j = (j+1) & (s->table_slots-1); }
+  s->table[j] = k;
+}
+
+/* Returns zero if the parser was already in the set */
+static int mpc_pset_add(mpc_pset_t *s, mpc_parser_t *p) {
+  
+  int j;
+  
+  if (mpc_pset_find(s, p) != -1) { return 0; }
+  
+  if (s->num == s->slots) {
+    s->slots *= 2;
+    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->slots);
+  }
+  
+  if ((s->num+1) * 2 > s->table_slots) {
+    s->table_slots *= 2;
+    s->table = realloc(s->table, sizeof(int) * s->table_slots);
+    for (j = 0; j < s->table_slots; j++) { s->table[j] = -1; }
+    for (j = 0; j < s->num; j++) { mpc_pset_insert(s, j); }
+  }
+  
+  s->parsers[s->num] = p;
+  mpc_pset_insert(s, s->num);
+  s->num++;
+  return 1;
+}
+
+static mpc_parser_t **mpc_parser_children(mpc_parser_t *p, int *n) {
+  
+  *n = 1;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return &p->data.expect.x;
+    case MPC_TYPE_APPLY:    return &p->data.apply.x;
+    case MPC_TYPE_APPLY_TO: return &p->data.apply_to.x;
+    case MPC_TYPE_PREDICT:  return &p->data.predict.x;
+    case MPC_TYPE_SPAN:     return &p->data.span.x;
+    case MPC_TYPE_MEMO:     return &p->data.memo.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    return &p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    return &p->data.repeat.x;
+    case MPC_TYPE_OR:  *n = p->data.or.n;  return p->data.or.xs;
+    case MPC_TYPE_AND: *n = p->data.and.n; return p->data.and.xs;
+    default: break;
+  }
+  
+  *n = 0;
+  return NULL;
+}
+
+/*
+** Optimiser
+**
+** Grammars built by mpca are made of binary "or"
+** and "and" nodes nested as deep as the rule is
+** long, each sequence starting with a "pass". The
+** parse loop pays a stack push for every node. The
+** optimiser rewrites the graph in place into wider,
+** shallower nodes which give the same outputs and
+** the same errors on every input:
+**
+**   - alternatives of an "or" which is itself an
+**     alternative are lifted into the parent
+**   - items of an AST sequence which is itself an
+**     item are lifted into the parent and any
+**     "pass" items dropped
+**   - a sequence of one item becomes that item
+**   - an "expect" directly inside another is removed
+**   - a folded sequence of literals inside an
+**     "expect" becomes a single string
+**
+** Retained parsers are never lifted or removed as
+** they may be referred to from elsewhere.
+*/
+
+/*
+** Folding a binary sequence nests the results,
+** but a sole result is passed on unwrapped. This
+** keeps that behaviour for sequences of any length.
+*/
+static mpc_val_t *mpcaf_fold_seq(int n, mpc_val_t **xs) {
+  int j, k = 0, last = 0;
+  for (j = 0; j < n; j++) {
+    if (xs[j] != NULL) { k++; last = j; }
+  }
+  if (k == 0) { return NULL; }
+  if (k == 1) { return xs[last]; }
+  return mpcf_fold_ast(n, xs);
+}
+
+static int mpc_optimise_seq(mpc_parser_t *p) {
+  
+  int j;
+  
+  if (p->type != MPC_TYPE_AND) { return 0; }
+  if (p->data.and.f != mpcaf_fold_seq
+  && !(p->data.and.f == mpcf_fold_ast && p->data.and.n == 2)) { return 0; }
+  
+  for (j = 0; j < p->data.and.n-1; j++) {
+    if (p->data.and.dxs[j] != (mpc_dtor_t)mpc_ast_delete) { return 0; }
+  }
+  
+  return 1;
+}
+
+static int mpc_optimise_literal(mpc_parser_t *p) {
+  if (p->retained) { return 0; }
+  if (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+  if (p->retained) { return 0; }
+  if (p->type == MPC_TYPE_SINGLE) { return p->data.single.x != '\0'; }
+  if (p->type == MPC_TYPE_STRING) { return 1; }
+  return 0;
+}
+
+static void mpc_optimise_or(mpc_parser_t *p) {
+  
+  int j, k, total = 0;
+  mpc_parser_t *x, **xs;
+  
+  for (j = 0; j < p->data.or.n; j++) {
+    x = p->data.or.xs[j];
+    total += (!x->retained && x->type == MPC_TYPE_OR && x->data.or.n > 0) ? x->data.or.n : 1;
+  }
+  
+  if (total == p->data.or.n) { return; }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * total);
+  total = 0;
+  
+  for (j = 0; j < p->data.or.n; j++) {
+    x = p->data.or.xs[j];
+    if (!x->retained && x->type == MPC_TYPE_OR && x->data.or.n > 0) {
+      for (k = 0; k < x->data.or.n; k++) { xs[total++] = x->data.or.xs[k]; }
+      free(x->data.or.xs);
+      free(x->data.or.predict);
+      free(x->data.or.predict_ix);
+      free(x->name);
+      free(x);
+    } else {
+      xs[total++] = x;
+    }
+  }
+  
+  free(p->data.or.xs);
+  free(p->data.or.predict);
+  free(p->data.or.predict_ix);
+  p->data.or.n = total;
+  p->data.or.xs = xs;
+  p->data.or.predict = NULL;
+  p->data.or.predict_ix = NULL;
+  
+}
+
+static void mpc_optimise_and(mpc_parser_t *p) {
+  
+  int j, k, total = 0;
+  mpc_parser_t *x, **xs;
+  
+  for (j = 0; j < p->data.and.n; j++) {
+    x = p->data.and.xs[j];
+    if (x->retained) { total++; }
+    else if (x->type == MPC_TYPE_PASS) { continue; }
+    else if (mpc_optimise_seq(x)) { total += x->data.and.n; }
+    else { total++; }
+  }
+  
+  if (total == p->data.and.n && total > 1) { return; }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * (total > 0 ? total : 1));
+  total = 0;
+  
+  for (j = 0; j < p->data.and.n; j++) {
+    x = p->data.and.xs[j];
+    if (x->retained) {
+      xs[total++] = x;
+    } else if (x->type == MPC_TYPE_PASS) {
+      free(x->name);
+      free(x);
+    } else if (mpc_optimise_seq(x)) {
+      for (k = 0; k < x->data.and.n; k++) { xs[total++] = x->data.and.xs[k]; }
+      free(x->data.and.xs);
+      free(x->data.and.dxs);
+      free(x->name);
+      free(x);
+    } else {
+      xs[total++] = x;
+    }
+  }
+  
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
+  /* Nothing left is a pass, and a single unretained item takes the place of the sequence */
+  if (total == 0) {
+    free(xs);
+    p->type = MPC_TYPE_PASS;
+    return;
+  }
+  
+  if (total == 1 && !xs[0]->retained) {
+    x = xs[0];
+    free(xs);
+    p->type = x->type;
+    p->data = x->data;
+    free(x->name);
+    free(x);
+    return;
+  }
+  
+  p->data.and.n = total;
+  p->data.and.f = mpcaf_fold_seq;
+  p->data.and.xs = xs;
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (total > 1 ? total-1 : 1));
+  for (j = 0; j < total-1; j++) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_ast_delete; }
+  
+}
+
+static void mpc_optimise_expect(mpc_parser_t *p) {
+  
+  int j;
+  size_t l = 0;
+  char *s;
+  mpc_parser_t *y, *x = p->data.expect.x;
+  
+  /* The outer expect replaces the inner one's errors */
+  while (!x->retained && x->type == MPC_TYPE_EXPECT) {
+    p->data.expect.x = x->data.expect.x;
+    free(x->data.expect.m);
+    free(x->name);
+    free(x);
+    x = p->data.expect.x;
+  }
+  
+  /*
+  ** The errors of a failed sequence of literals are
+  ** replaced here too, so it can match in one go.
+  */
+  
+  if (x->retained || x->type != MPC_TYPE_AND
+  ||  x->data.and.f != mpcf_strfold || x->data.and.n < 2) { return; }
+  
+  for (j = 0; j < x->data.and.n; j++) {
+    if (!mpc_optimise_literal(x->data.and.xs[j])) { return; }
+  }
+  
+  s = malloc(x->data.and.n + 1);
+  for (j = 0; j < x->data.and.n; j++) {
+    y = x->data.and.xs[j];
+    if (y->type == MPC_TYPE_EXPECT) { y = y->data.expect.x; }
+    if (y->type == MPC_TYPE_SINGLE) {
+      s = realloc(s, l + 2);
+      s[l++] = y->data.single.x;
+    } else {
+      s = realloc(s, l + strlen(y->data.string.x) + 1);
+      memcpy(s + l, y->data.string.x, strlen(y->data.string.x));
+      l += strlen(y->data.string.x);
+    }
+    mpc_undefine_unretained(x->data.and.xs[j], 0);
+  }
+  s[l] = '\0';
+  
+  free(x->data.and.xs);
+  free(x->data.and.dxs);
+  x->type = MPC_TYPE_STRING;
+  x->data.string.x = s;
+  
+}
+
+static void mpc_optimise_visit(mpc_pset_t *s, mpc_parser_t *p) {
+  
+  int j, n;
+  mpc_parser_t **xs;
+  
+  if (p == NULL || p->type == MPC_TYPE_UNDEFINED || !mpc_pset_add(s, p)) { return; }
+  
+  xs = mpc_parser_children(p, &n);
+  for (j = 0; j < n; j++) { mpc_optimise_visit(s, xs[j]); }
+  
+  switch (p->type) {
+    case MPC_TYPE_OR:     mpc_optimise_or(p); break;
+    case MPC_TYPE_AND:    if (mpc_optimise_seq(p)) { mpc_optimise_and(p); } break;
+    case MPC_TYPE_EXPECT: mpc_optimise_expect(p); break;
+    default: break;
+  }
+  
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_pset_t s;
+  mpc_pset_init(&s);
+  mpc_optimise_visit(&s, p);
+  mpc_pset_clear(&s);
+}
+
+/*
+** First Sets
+**
+** After a grammar is defined we compute, for
+** every parser reachable from its rules, the set
+** of bytes a successful match can begin with and
+** whether it can succeed without consuming any
+** input. Rules refer to each other (and often to
+** themselves) so the sets are grown until they
+** stop changing.
+**
+** Any "or" with no nullable alternatives then
+** gets a table from each byte to the alternatives
+** that could possibly match there. The parse loop
+** uses it to go straight to the right alternative
+** rather than trying each in turn.
+**
+** Parsers using "not" can turn a later success
+** into a failure at an earlier position, which
+** would change the errors reported, so grammars
+** containing them are left alone. So are grammars
+** still referring to undefined rules.
+*/
+
+typedef struct {
+  mpc_pset_t set;
+  unsigned char *first;
+  char *nullable;
+  int unsafe;
+} mpc_first_t;
+
+static int mpc_first_find(mpc_first_t *f, mpc_parser_t *p) {
+  return mpc_pset_find(&f->set, p);
+}
+
+static void mpc_first_add(mpc_first_t *f, mpc_parser_t *p) {
+  
+  int j, n;
+  mpc_parser_t **xs;
+  
+  if (p == NULL || p->type == MPC_TYPE_NOT || p->type == MPC_TYPE_UNDEFINED) {
+    f->unsafe = 1;
+    return;
+  }
+  
+  if (!mpc_pset_add(&f->set, p)) { return; }
+  
+  xs = mpc_parser_children(p, &n);
+  for (j = 0; j < n; j++) { mpc_first_add(f, xs[j]); }
+  
+}
+
+static void mpc_first_union(unsigned char *x, unsigned char *y) {
+  int j;
+  for (j = 0; j < 32; j++) { x[j] |= y[j]; }
+}
+
+static void mpc_first_set(unsigned char *x, int c) {
+  x[c >> 3] |= 1 << (c & 7);
+}
+
+static int mpc_first_has(unsigned char *x, int c) {
+  return x[c >> 3] & (1 << (c & 7));
+}
+
+static int mpc_first_update(mpc_first_t *f, int k) {
+  
+  mpc_parser_t *p = f->set.parsers[k];
+  mpc_parser_t **xs;
+  unsigned char first[32];
+  char nullable = 0;
+  int j, n, x;
+  char c;
+  
+  memset(first, 0, 32);
+  xs = mpc_parser_children(p, &n);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      nullable = 1;
+      break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(first, 0xFF, 32);
+      break;
+    
+    case MPC_TYPE_SINGLE:
+      mpc_first_set(first, (unsigned char)p->data.single.x);
+      break;
+    
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 256; j++) {
+        c = (char)j;
+        if (c >= p->data.range.x && c <= p->data.range.y) { mpc_first_set(first, j); }
+      }
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < 256; j++) {
+        if ((strchr(p->data.string.x, (char)j) != 0) == (p->type == MPC_TYPE_ONEOF)) {
+          mpc_first_set(first, j);
+        }
+      }
+      break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) {
+        mpc_first_set(first, (unsigned char)p->data.string.x[0]);
+      } else {
+        nullable = 1;
+      }
+      break;
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_SPAN:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_MANY1:
+      x = mpc_first_find(f, xs[0]);
+      mpc_first_union(first, f->first + x * 32);
+      nullable = f->nullable[x];
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_COUNT:
+      x = mpc_first_find(f, xs[0]);
+      mpc_first_union(first, f->first + x * 32);
+      nullable = f->nullable[x] || p->type != MPC_TYPE_COUNT || p->data.repeat.n == 0;
+      break;
+    
+    /* Predictions are only made on strings, where the table decides */
+    case MPC_TYPE_DFA:
+      nullable = p->data.dfa.accept[0];
+      for (j = 0; j < 256; j++) {
+        if (p->data.dfa.table[j] >= 0) { mpc_first_set(first, j); }
+      }
+      break;
+    
+    case MPC_TYPE_OR:
+      nullable = n == 0;
+      for (j = 0; j < n; j++) {
+        x = mpc_first_find(f, xs[j]);
+        mpc_first_union(first, f->first + x * 32);
+        nullable = nullable || f->nullable[x];
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      nullable = 1;
+      for (j = 0; j < n && nullable; j++) {
+        x = mpc_first_find(f, xs[j]);
+        mpc_first_union(first, f->first + x * 32);
+        nullable = f->nullable[x];
+      }
+      break;
+    
+    default: break;
+  }
+  
+  if (nullable && !f->nullable[k]) {
+    f->nullable[k] = 1;
+    mpc_first_union(f->first + k * 32, first);
+    return 1;
+  }
+  
+  for (j = 0; j < 32; j++) {
+    if (first[j] & ~f->first[k * 32 + j]) {
+      mpc_first_union(f->first + k * 32, first);
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+static void mpc_first_predict(mpc_first_t *f, mpc_parser_t *p) {
+  
+  int j, k, n, m, x, pass, total = 0, prev = 0;
+  int *predict, *predict_ix;
+  
+  n = p->data.or.n;
+  if (n < 2) { return; }
+  
+  for (k = 0; k < n; k++) {
+    if (f->nullable[mpc_first_find(f, p->data.or.xs[k])]) { return; }
+  }
+  
+  /*
+  ** For each byte every alternative is listed, the
+  ** possible matches first, and their count stored
+  ** next to where the list starts. Neighbouring
+  ** bytes (letters, digits) usually share a list.
+  */
+  
+  predict = malloc(sizeof(int) * 512);
+  predict_ix = malloc(sizeof(int) * 256 * n);
+  
+  for (j = 0; j < 256; j++) {
+    m = 0;
+    for (pass = 1; pass >= 0; pass--) {
+      for (k = 0; k < n; k++) {
+        x = mpc_first_find(f, p->data.or.xs[k]);
+        if (!mpc_first_has(f->first + x * 32, j) == !pass) { predict_ix[total + m++] = k; }
+      }
+      if (pass) { predict[j*2+1] = m; }
+    }
+    predict[j*2+0] = total;
+    if (j > 0 && predict[j*2+1] == predict[prev*2+1]
+    && memcmp(predict_ix + predict[prev*2], predict_ix + total, sizeof(int) * n) == 0) {
+      predict[j*2+0] = predict[prev*2];
+    } else {
+      total += n;
+      prev = j;
+    }
+  }
+  
+  free(p->data.or.predict);
+  free(p->data.or.predict_ix);
+  
+  /* Nothing gained if every byte allows every alternative */
+  for (j = 0; j < 256; j++) {
+    if (predict[j*2+1] != n) { break; }
+  }
+  
+  if (j == 256) {
+    free(predict);
+    free(predict_ix);
+    p->data.or.predict = NULL;
+    p->data.or.predict_ix = NULL;
+  } else {
+    p->data.or.predict = predict;
+    p->data.or.predict_ix = realloc(predict_ix, sizeof(int) * total);
+  }
+  
+}
+
+static void mpc_first_analyse(int n, mpc_parser_t **ps) {
+  
+  mpc_first_t f;
+  int j, changed;
+  
+  mpc_pset_init(&f.set);
+  f.unsafe = 0;
+  
+  for (j = 0; j < n; j++) { mpc_first_add(&f, ps[j]); }
+  
+  if (!f.unsafe) {
+    
+    f.first = calloc(f.set.num, 32);
+    f.nullable = calloc(f.set.num, 1);
+    
+    do {
+      changed = 0;
+      for (j = 0; j < f.set.num; j++) { changed |= mpc_first_update(&f, j); }
+    } while (changed);
+    
+    for (j = 0; j < f.set.num; j++) {
+      if (f.set.parsers[j]->type == MPC_TYPE_OR) { mpc_first_predict(&f, f.set.parsers[j]); }
+    }
+    
+    free(f.first);
+    free(f.nullable);
+  }
+  
+  mpc_pset_clear(&f.set);
+  
+}
+
+static void mpca_lang_optimise(int n, mpc_parser_t **ps) {
+  
+  int j;
+  mpc_pset_t s;
+  
+  mpc_pset_init(&s);
+  for (j = 0; j < n; j++) { mpc_optimise_visit(&s, ps[j]); }
+  mpc_pset_clear(&s);
+  
+  mpc_first_analyse(n, ps);
+}
+
 /*
 ** Grammar Parser
 */
@@ -2931,6 +4975,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPC_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPC_LANG_MEMOIZE) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -2939,6 +4984,8 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   }
   free(x);
   
+  mpca_lang_optimise(st->parsers_num, st->parsers);
+  
   return NULL;
 }
 
@@ -56,10 +56,23 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parse contexts can be reused for many parses of
+** strings, keeping their stacks between them.
+*/
+
+typedef struct mpc_ctx_t mpc_ctx_t;
+
+mpc_ctx_t *mpc_ctx_new(void);
+void mpc_ctx_delete(mpc_ctx_t *c);
+int mpc_ctx_parse(mpc_ctx_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_ctx_nparse(mpc_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -82,6 +95,14 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+/*
+** Rewrites a parser and everything it refers to
+** into fewer, wider nodes that parse the same. It
+** is run on grammars built by mpca_lang already.
+*/
+
+void mpc_optimise(mpc_parser_t *p);
+
 /*
 ** Basic Parsers
 */
@@ -123,6 +144,15 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Spans match `a` and output the input it consumed
+** as a single string. The outputs of `a` itself
+** are not built so any folds inside must accept
+** NULL values, as `mpcf_strfold` does.
+*/
+
+mpc_parser_t *mpc_span(mpc_parser_t *a);
+
 /*
 ** Common Parsers
 */
@@ -239,11 +269,22 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** Tags are shared between nodes and must not be
+** modified. Each distinct tag has an integer
+** `tag_id` which can be used in place of comparing
+** tag strings. Nodes built during a parse belong
+** to that parse and are freed together when the
+** AST it output is deleted.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
+  int tag_id;
   char *contents;
   int children_num;
   struct mpc_ast_t** children;
+  void *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -253,6 +294,8 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 
@@ -276,14 +319,37 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
 
+/*
+** Memoizing an AST parser stores its result at
+** each input position, so retrying it at the same
+** position (such as in another alternative of an
+** `or`) copies the stored result rather than
+** parsing again. Results are kept per parse, only
+** for string inputs, and up to a fixed bound.
+** The stats count the hits and misses of parses
+** run on the calling thread since it started.
+*/
+
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
+void mpca_memo_stats(unsigned long *hits, unsigned long *misses);
+
 enum {
   MPC_LANG_DEFAULT              = 0,
   MPC_LANG_PREDICTIVE           = 1,
-  MPC_LANG_WHITESPACE_SENSITIVE = 2
+  MPC_LANG_WHITESPACE_SENSITIVE = 2,
+  MPC_LANG_MEMOIZE              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
 
+/*
+** Once its rules are defined and optimised mpca_lang
+** works out which bytes each alternative can start with, so
+** parsing strings only tries the alternatives that
+** could match the next byte. Errors are unchanged.
+** This assumes the rules are not redefined later.
+*/
+
 mpc_err_t *mpca_lang(int flags, const char *language, ...);
 mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
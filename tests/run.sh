@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs each tests/*.hisp and compares what hisp prints with tests/*.out.
+# A first line of "; args: ..." gives extra options to pass to hisp.
+
+status=0
+for t in tests/*.hisp; do
+  args=$(sed -n '1s/^; args: //p' "$t")
+  if ./hisp $args "$t" 2>&1 | cmp -s - "${t%.hisp}.out"; then
+    echo "ok   $t"
+  else
+    echo "FAIL $t"
+    status=1
+  fi
+done
+exit $status